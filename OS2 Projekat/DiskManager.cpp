@@ -2,91 +2,347 @@
 #include <cstring>
 
 #include "DiskManager.h"
+#include "FilePartition.h"
 #include "vm_declarations.h"
 
-DiskManager::DiskManager(Partition* partition_) {
-	partition = partition_;												// assign the partition pointer
-																		// create cluster usage vector
-
-	clusterUsageVectorSize = partition->getNumOfClusters();
-	clusterUsageVector = new ClusterNo[clusterUsageVectorSize];
-	clusterUsageVectorHead = 0;
-
-	for (ClusterNo i = 0; i < clusterUsageVectorSize - 1; i++) {		// initialise it
-		clusterUsageVector[i] = i + 1;
-	}
-	clusterUsageVector[clusterUsageVectorSize - 1] = -1;
-
-	numberOfFreeClusters = clusterUsageVectorSize;						// assign number of free clusters
+DiskManager::DiskManager(Partition* partition_) : policy(ROUND_ROBIN) {
+	initialiseStripes(&partition_, 1);									// a single partition is a single stripe
+}
 
+DiskManager::DiskManager(Partition** partitions, unsigned short numberOfPartitions, StripingPolicy policy_) : policy(policy_) {
+	if (numberOfPartitions > maxPartitions) numberOfPartitions = maxPartitions;
+	initialiseStripes(partitions, numberOfPartitions);
 }
 
 DiskManager::~DiskManager() {
-	delete[] clusterUsageVector;
-}
+	for (Stripe* stripe : stripes) {									// let the workers finish what was queued and stop
+		stripe->queueMutex.lock();
+		stripe->stopWorker = true;
+		stripe->queueMutex.unlock();
+		stripe->queueCondition.notify_one();
+		stripe->worker.join();
 
-ClusterNo DiskManager::write(void* content) {
+		delete[] stripe->clusterBitmap;
+		delete[] stripe->extraReferences;
+		delete stripe;
+	}
+}
 
-	if (clusterUsageVector[clusterUsageVectorHead] == -1) return -1;	// exception -- no free clusters
+ClusterNo DiskManager::write(void* content, ClusterNo hint) {
 
-	ClusterNo chosenCluster = clusterUsageVectorHead;					// choose a free cluster and move the free cluster head
-	clusterUsageVectorHead = clusterUsageVector[clusterUsageVectorHead];
+	ClusterNo chosenCluster = allocateExtent(1, hint);					// choose a free cluster as close to the hint as possible
+	if (chosenCluster == noCluster) return noCluster;					// exception -- no free clusters
 
-	if (!partition->writeCluster(chosenCluster, (char*)content))		// Write the content onto the partition.
-		return -1;														// return -1 in case of error
+	Stripe* stripe; ClusterNo localCluster;
+	if (!decodeCluster(chosenCluster, stripe, localCluster)) {
+		freeCluster(chosenCluster);
+		return noCluster;
+	}
 
-	numberOfFreeClusters--;												// decrease the free cluster counter
+	if (!writeCluster(stripe, localCluster, (char*)content)) {			// Write the content onto the partition.
+		freeCluster(chosenCluster);
+		return noCluster;												// return -1 in case of error
+	}
 
 	return chosenCluster;
 }
 
 bool DiskManager::writeToCluster(void* content, ClusterNo cluster) {
-	if (cluster < 0 || cluster >= clusterUsageVectorSize) return false;
+	Stripe* stripe; ClusterNo localCluster;
+	if (!decodeCluster(cluster, stripe, localCluster)) return false;
 
-	if (!partition->writeCluster(cluster, (char*)content))				// Write the content onto the partition.
+	if (!writeCluster(stripe, localCluster, (char*)content))			// Write the content onto the partition.
 		return false;													// return false in case of error
 
 	return true;
 }
 
-ClusterNo DiskManager::writeFromCluster(ClusterNo cluster) {
-	if (clusterUsageVector[clusterUsageVectorHead] == -1) return -1;	// exception -- no free clusters
+bool DiskManager::read(PhysicalAddress block, ClusterNo cluster) {
 
-	ClusterNo chosenCluster = clusterUsageVectorHead;					// choose a free cluster and move the free cluster head
-	clusterUsageVectorHead = clusterUsageVector[clusterUsageVectorHead];
+	Stripe* stripe; ClusterNo localCluster;
+	if (!decodeCluster(cluster, stripe, localCluster)) return false;
+
+	if (stripe->mappedPartition) {										// no intermediate buffer is needed for a mapped partition
+		memcpy(block, stripe->mappedPartition->getMappedCluster(localCluster), ClusterSize);
+		return true;
+	}
 
 	char* buffer = new char[ClusterSize];
 
-	if (!partition->readCluster(cluster, buffer))
-		return -1;														// read from partition was unsuccessful
-	if (!partition->writeCluster(chosenCluster, buffer))				// Write the content onto the partition.
-		return -1;														// return -1 in case of error
+	if (!readCluster(stripe, localCluster, buffer)) {
+		delete[] buffer;
+		return false;													// read from partition was unsuccessful
+	}
+
+	memcpy(block, buffer, ClusterSize);									// copy contents from buffer into physical block memory
 
 	delete[] buffer;
-	numberOfFreeClusters--;												// decrease the free cluster counter
+
+	return true;
+}
+
+ClusterNo DiskManager::writeAsync(void* content, ClusterNo hint) {
+
+	ClusterNo chosenCluster = allocateExtent(1, hint);
+	if (chosenCluster == noCluster) return noCluster;					// exception -- no free clusters
+
+	Stripe* stripe; ClusterNo localCluster;
+	if (!decodeCluster(chosenCluster, stripe, localCluster)) {
+		freeCluster(chosenCluster);
+		return noCluster;
+	}
+	queueWrite(stripe, localCluster, (char*)content);
+
 	return chosenCluster;
 }
 
-bool DiskManager::read(PhysicalAddress block, ClusterNo cluster) {
+bool DiskManager::writeToClusterAsync(void* content, ClusterNo cluster) {
+	Stripe* stripe; ClusterNo localCluster;
+	if (!decodeCluster(cluster, stripe, localCluster)) return false;
 
-	if (cluster < 0 || cluster >= clusterUsageVectorSize) return false;
+	queueWrite(stripe, localCluster, (char*)content);
+	return true;
+}
 
-	char* buffer = new char[ClusterSize];
+bool DiskManager::completeAll() {
 
-	if (!partition->readCluster(cluster, buffer))
-		return false;													// read from partition was unsuccessful
+	bool success = true;
 
-	memcpy(block, buffer, ClusterSize);									// copy contents from buffer into physical block memory
+	for (Stripe* stripe : stripes) {
+		std::unique_lock<std::mutex> lock(stripe->queueMutex);
+		stripe->completionCondition.wait(lock, [stripe] { return stripe->pendingRequests == 0; });
+		if (stripe->failedRequests) success = false;
+		stripe->failedRequests = 0;
+	}
 
-	delete[] buffer;
+	return success;
+}
 
-	return true;
+ClusterNo DiskManager::allocateExtent(ClusterNo clustersNeeded, ClusterNo hint) {
+
+	std::lock_guard<std::mutex> guard(allocationMutex);
+
+	if (!clustersNeeded || numberOfFreeClusters < clustersNeeded) return noCluster;
+
+	Stripe* hintStripe = nullptr; ClusterNo localHint = noCluster;
+	if (hint != noCluster) decodeCluster(hint, hintStripe, localHint);
+
+	unsigned short firstPartition = choosePartition(clustersNeeded);
+	for (unsigned short i = 0; i < stripes.size(); i++) {				// the chosen partition first, then the others in order
+		unsigned short partitionIndex = (firstPartition + i) % stripes.size();
+		Stripe* stripe = stripes[partitionIndex];
+		if (stripe->numberOfFreeClusters < clustersNeeded) continue;
+
+		ClusterNo from = stripe == hintStripe ? localHint : stripe->allocationCursor;	// a hint on another partition is of no use here
+
+		ClusterNo first = findFreeRun(stripe, clustersNeeded, from, stripe->numberOfClusters);	// look past the hint first, then wrap around
+		if (first == noCluster) {
+			ClusterNo wrapLimit = from + clustersNeeded - 1 < stripe->numberOfClusters ? from + clustersNeeded - 1 : stripe->numberOfClusters;
+			first = findFreeRun(stripe, clustersNeeded, 0, wrapLimit);
+		}
+		if (first == noCluster) continue;								// free space is too fragmented for this extent
+
+		markClusters(stripe, first, clustersNeeded, false);
+		stripe->numberOfFreeClusters -= clustersNeeded;
+		numberOfFreeClusters -= clustersNeeded;
+		stripe->allocationCursor = (first + clustersNeeded) % stripe->numberOfClusters;
+
+		return encodeCluster(partitionIndex, first);
+	}
+
+	return noCluster;
 }
 
 void DiskManager::freeCluster(ClusterNo clusterNumber) {
 
-	clusterUsageVector[clusterNumber] = clusterUsageVectorHead;
-	clusterUsageVectorHead = clusterNumber;								// optimised for a physical hard disk because of the head positioning
+	std::lock_guard<std::mutex> guard(allocationMutex);
+
+	Stripe* stripe; ClusterNo localCluster;
+	if (!decodeCluster(clusterNumber, stripe, localCluster) || isFree(stripe, localCluster)) return;
 
+	if (stripe->extraReferences[localCluster] > 0) {					// other pages still hold the cluster
+		stripe->extraReferences[localCluster]--;
+		return;
+	}
+
+	markClusters(stripe, localCluster, 1, true);
+
+	stripe->numberOfFreeClusters++;
 	numberOfFreeClusters++;
-}
\ No newline at end of file
+}
+
+void DiskManager::addClusterReference(ClusterNo clusterNumber) {
+	std::lock_guard<std::mutex> guard(allocationMutex);
+	Stripe* stripe; ClusterNo localCluster;
+	if (decodeCluster(clusterNumber, stripe, localCluster)) stripe->extraReferences[localCluster]++;
+}
+
+unsigned DiskManager::getClusterReferences(ClusterNo clusterNumber) {
+	Stripe* stripe; ClusterNo localCluster;								// (the stripes never change, no lock is needed)
+	if (!decodeCluster(clusterNumber, stripe, localCluster)) return 1;
+	return stripe->extraReferences[localCluster] + 1;
+}
+
+// private methods
+
+void DiskManager::initialiseStripes(Partition** partitions, unsigned short numberOfPartitions) {
+
+	numberOfFreeClusters = 0;
+
+	for (unsigned short i = 0; i < numberOfPartitions; i++) {
+		Stripe* stripe = new Stripe();
+		stripe->partition = partitions[i];
+																		// create the cluster bitmap
+		stripe->numberOfClusters = stripe->partition->getNumOfClusters();
+		if (stripe->numberOfClusters > localClusterMask)				// the rest of the partition can't be addressed
+			stripe->numberOfClusters = localClusterMask;
+		stripe->bitmapSize = (stripe->numberOfClusters + bitsPerWord - 1) / bitsPerWord;
+		stripe->clusterBitmap = new BitmapWord[stripe->bitmapSize];
+
+		memset(stripe->clusterBitmap, 0, stripe->bitmapSize * sizeof(BitmapWord));	// bits past the last cluster stay 0 so they are never handed out
+		markClusters(stripe, 0, stripe->numberOfClusters, true);
+		stripe->extraReferences = new std::atomic<unsigned>[stripe->numberOfClusters]();	// no cluster is held by several pages yet
+
+		stripe->numberOfFreeClusters = stripe->numberOfClusters;
+		numberOfFreeClusters += stripe->numberOfClusters;
+
+#ifndef _WIN32
+		stripe->mappedPartition = dynamic_cast<FilePartition*>(stripe->partition);	// a mapped partition is accessed without system calls
+		if (stripe->mappedPartition && !stripe->mappedPartition->getMappedCluster(0))
+			stripe->mappedPartition = nullptr;
+#endif
+
+		stripe->worker = std::thread(ioWorker, this, stripe);
+		stripes.push_back(stripe);
+	}
+
+}
+
+unsigned short DiskManager::choosePartition(ClusterNo clustersNeeded) {
+
+	if (policy == ROUND_ROBIN) {
+		for (unsigned short i = 0; i < stripes.size(); i++) {
+			unsigned short partitionIndex = nextPartition;
+			nextPartition = (nextPartition + 1) % stripes.size();
+			if (stripes[partitionIndex]->numberOfFreeClusters >= clustersNeeded) return partitionIndex;
+		}
+		return 0;
+	}
+																		// LEAST_LOADED: fewest pending writes, then most free clusters
+	unsigned short chosenPartition = 0;
+	unsigned chosenPending = (unsigned)-1;
+	ClusterNo chosenFree = 0;
+	for (unsigned short i = 0; i < stripes.size(); i++) {
+		Stripe* stripe = stripes[i];
+		if (stripe->numberOfFreeClusters < clustersNeeded) continue;
+
+		stripe->queueMutex.lock();
+		unsigned pending = stripe->pendingRequests;
+		stripe->queueMutex.unlock();
+
+		if (pending < chosenPending || (pending == chosenPending && stripe->numberOfFreeClusters > chosenFree)) {
+			chosenPartition = i;
+			chosenPending = pending;
+			chosenFree = stripe->numberOfFreeClusters;
+		}
+	}
+	return chosenPartition;
+}
+
+ClusterNo DiskManager::findFreeRun(Stripe* stripe, ClusterNo length, ClusterNo from, ClusterNo to) {
+
+	ClusterNo runStart = from, runLength = 0;
+
+	for (ClusterNo i = from; i < to;) {
+		BitmapWord word = stripe->clusterBitmap[i / bitsPerWord];
+
+		if (i % bitsPerWord == 0 && (word == 0 || word == ~(BitmapWord)0)) {	// whole words are skipped or counted at once
+			if (word == 0) runLength = 0;
+			else {
+				if (!runLength) runStart = i;
+				runLength += bitsPerWord;
+				if (runLength >= length && runStart + length <= to) return runStart;
+			}
+			i += bitsPerWord;
+			continue;
+		}
+
+		if ((word >> (i % bitsPerWord)) & 1) {
+			if (!runLength) runStart = i;
+			if (++runLength == length) return runStart;
+		}
+		else runLength = 0;
+		i++;
+	}
+
+	return noCluster;
+}
+
+void DiskManager::markClusters(Stripe* stripe, ClusterNo first, ClusterNo length, bool free) {
+	for (ClusterNo i = first; i < first + length; i++) {
+		if (free) stripe->clusterBitmap[i / bitsPerWord] |= (BitmapWord)1 << (i % bitsPerWord);
+		else stripe->clusterBitmap[i / bitsPerWord] &= ~((BitmapWord)1 << (i % bitsPerWord));
+	}
+}
+
+bool DiskManager::decodeCluster(ClusterNo cluster, Stripe*& stripe, ClusterNo& localCluster) {
+	ClusterNo partitionIndex = cluster >> partitionShift;
+	if (partitionIndex >= stripes.size()) return false;
+
+	stripe = stripes[partitionIndex];
+	localCluster = cluster & localClusterMask;
+	return localCluster < stripe->numberOfClusters;
+}
+
+bool DiskManager::readCluster(Stripe* stripe, ClusterNo cluster, char* buffer) {
+	if (stripe->mappedPartition) {
+		memcpy(buffer, stripe->mappedPartition->getMappedCluster(cluster), ClusterSize);
+		return true;
+	}
+	std::lock_guard<std::mutex> guard(stripe->ioMutex);
+	return stripe->partition->readCluster(cluster, buffer) != 0;
+}
+
+bool DiskManager::writeCluster(Stripe* stripe, ClusterNo cluster, const char* buffer) {
+	if (stripe->mappedPartition) {
+		memcpy(stripe->mappedPartition->getMappedCluster(cluster), buffer, ClusterSize);
+		return true;
+	}
+	std::lock_guard<std::mutex> guard(stripe->ioMutex);
+	return stripe->partition->writeCluster(cluster, buffer) != 0;
+}
+
+void DiskManager::queueWrite(Stripe* stripe, ClusterNo cluster, const char* buffer) {
+
+	if (stripe->mappedPartition) {										// nothing to gain from the worker, the write is a memcpy()
+		writeCluster(stripe, cluster, buffer);
+		return;
+	}
+
+	stripe->queueMutex.lock();
+	stripe->requests.push_back(IORequest{ cluster, buffer });
+	stripe->pendingRequests++;
+	stripe->queueMutex.unlock();
+	stripe->queueCondition.notify_one();
+}
+
+void DiskManager::ioWorker(DiskManager* manager, Stripe* stripe) {
+
+	std::unique_lock<std::mutex> lock(stripe->queueMutex);
+
+	while (true) {
+		stripe->queueCondition.wait(lock, [stripe] { return stripe->stopWorker || !stripe->requests.empty(); });
+		if (stripe->requests.empty()) return;							// stopping and nothing left to do
+
+		IORequest request = stripe->requests.front();
+		stripe->requests.pop_front();
+
+		lock.unlock();													// the partition is accessed while new requests are being queued
+		bool success = manager->writeCluster(stripe, request.cluster, request.buffer);
+		lock.lock();
+
+		if (!success) stripe->failedRequests++;
+		if (--stripe->pendingRequests == 0)
+			stripe->completionCondition.notify_all();
+	}
+}
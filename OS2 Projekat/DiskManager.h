@@ -1,38 +1,119 @@
 #ifndef _diskmanager_h_
 
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
 #include "part.h"
 #include "vm_declarations.h"
 
 #define _diskmanager_h_
 
+class FilePartition;
+
 class DiskManager {
 
 public:
 
+	static const ClusterNo noCluster = (ClusterNo)-1;		// returned when no cluster could be reserved, also means "no locality hint"
+
+															// Cluster numbers handed out by the manager are (partition index << partitionShift) | cluster on that partition.
+	static const unsigned short partitionShift = 24;
+	static const unsigned short maxPartitions = 255;		// partition 255 is left out so that noCluster can never be a valid cluster
+
 	DiskManager(Partition*);
+	DiskManager(Partition** partitions, unsigned short numberOfPartitions, StripingPolicy policy = ROUND_ROBIN);
 	~DiskManager();
 
-	ClusterNo write(void* content);							// Writes contents onto the partition and returns the number of the cluster they were written on.
+															// Writes contents onto the partition and returns the number of the cluster they were written on.
+	ClusterNo write(void* content, ClusterNo hint = noCluster);	// The cluster is searched for starting from _hint_ (eg. next to a neighbouring page's cluster).
 	bool writeToCluster(void* content, ClusterNo cluster);	// Writes content to an exact cluster (used when the location on the disk for a page is known).
-	ClusterNo writeFromCluster(ClusterNo cluster);			// Writes from an exact cluster to a new cluster and returns its number.
 
 	bool read(PhysicalAddress block, ClusterNo cluster);	// Reads a cluster from the disk.
 
-	bool hasEnoughSpace(ClusterNo clustersNeeded) { return numberOfFreeClusters >= clustersNeeded; }
+															// Asynchronous versions of write() and writeToCluster(), carried out by the partition's I/O worker.
+	ClusterNo writeAsync(void* content, ClusterNo hint = noCluster);	// The cluster is reserved immediately, _content_ must stay untouched until completeAll().
+	bool writeToClusterAsync(void* content, ClusterNo cluster);
+	bool completeAll();										// Waits for all queued writes, false if any of them failed. Must be called before the system mutex is released.
+
+															// Reserves _clustersNeeded_ contiguous clusters (on a single partition), searching from _hint_ onwards first.
+	ClusterNo allocateExtent(ClusterNo clustersNeeded, ClusterNo hint = noCluster);	// Returns the first cluster of the extent or noCluster.
 
-	void freeCluster(ClusterNo clusterNumber);				// Returns a cluster to the free cluster pool (eg. when a process is deleted).
+	bool hasEnoughSpace(ClusterNo clustersNeeded) { return getNumberOfFreeClusters() >= clustersNeeded; }
+	ClusterNo getNumberOfFreeClusters() { std::lock_guard<std::mutex> guard(allocationMutex); return numberOfFreeClusters; }
+	unsigned short getNumberOfPartitions() const { return (unsigned short)stripes.size(); }
+
+	void freeCluster(ClusterNo clusterNumber);				// Drops a reference to a cluster, it returns to the free cluster pool with the last one (eg. when a process is deleted).
+
+	void addClusterReference(ClusterNo clusterNumber);		// Another page holds the cluster (cloned or merged pages).
+	bool isClusterShared(ClusterNo clusterNumber) { return getClusterReferences(clusterNumber) > 1; }
+	unsigned getClusterReferences(ClusterNo clusterNumber);
 
 private:
 
-	Partition* partition;									// Pointer to the partition.
+	typedef unsigned long long BitmapWord;
+	static const ClusterNo bitsPerWord = sizeof(BitmapWord) * 8;
+	static const ClusterNo localClusterMask = ((ClusterNo)1 << partitionShift) - 1;
+
+	struct IORequest {
+		ClusterNo cluster;									// cluster on the stripe's partition
+		const char* buffer;
+	};
+
+	struct Stripe {											// one partition of the swap space
+		Partition* partition;
+		FilePartition* mappedPartition = nullptr;			// Set if the partition is a memory mapped FilePartition.
+
+		BitmapWord* clusterBitmap;							// One bit per cluster, 1 if the cluster is free.
+		std::atomic<unsigned>* extraReferences;				// Per cluster, references held besides the first one (changed under the allocation
+															// lock, read without it).
+		ClusterNo bitmapSize;								// Number of words in the bitmap.
+
+		ClusterNo numberOfClusters;
+		ClusterNo numberOfFreeClusters;
+		ClusterNo allocationCursor = 0;						// End of the last reserved extent, used when no hint is given (next fit).
+
+		std::mutex ioMutex;									// serialises calls into the partition (the caller's reads and the worker's writes)
+
+		std::thread worker;									// I/O worker, takes requests off the queue
+		std::deque<IORequest> requests;
+		std::mutex queueMutex;
+		std::condition_variable queueCondition;				// signalled when a request is queued or the worker should stop
+		std::condition_variable completionCondition;		// signalled when the last pending request is done
+		unsigned pendingRequests = 0;						// queued + in progress
+		unsigned failedRequests = 0;
+		bool stopWorker = false;
+	};
+
+	void initialiseStripes(Partition** partitions, unsigned short numberOfPartitions);
+
+	unsigned short choosePartition(ClusterNo clustersNeeded);	// applies the striping policy, picks among partitions with enough free clusters
+
+	ClusterNo findFreeRun(Stripe* stripe, ClusterNo length, ClusterNo from, ClusterNo to);	// first run of _length_ free clusters inside [from, to), noCluster if none
+	void markClusters(Stripe* stripe, ClusterNo first, ClusterNo length, bool free);
+	bool isFree(Stripe* stripe, ClusterNo cluster) { return (stripe->clusterBitmap[cluster / bitsPerWord] >> (cluster % bitsPerWord)) & 1; }
+
+	bool decodeCluster(ClusterNo cluster, Stripe*& stripe, ClusterNo& localCluster);	// false if the cluster doesn't exist
+	static ClusterNo encodeCluster(unsigned short partitionIndex, ClusterNo localCluster) { return ((ClusterNo)partitionIndex << partitionShift) | localCluster; }
+
+	bool readCluster(Stripe* stripe, ClusterNo cluster, char* buffer);	// Partition access, a plain memcpy() if the partition is memory mapped.
+	bool writeCluster(Stripe* stripe, ClusterNo cluster, const char* buffer);
+	void queueWrite(Stripe* stripe, ClusterNo cluster, const char* buffer);
+
+	static void ioWorker(DiskManager* manager, Stripe* stripe);
+
+	std::vector<Stripe*> stripes;							// the partitions, in the order they were given
+	StripingPolicy policy;
+	unsigned short nextPartition = 0;						// round robin position
 
-	ClusterNo* clusterUsageVector;							// Vector of free clusters. Index inside the vector points to the next free cluster number.
+	ClusterNo numberOfFreeClusters;							// Free clusters remaining on all of the partitions.
 
-	ClusterNo clusterUsageVectorHead = 0;					// Indicates the first next free cluster.
-	ClusterNo clusterUsageVectorSize;						// Size of the vector (equal to number of clusters on the partition).
-	ClusterNo numberOfFreeClusters;							// Free clusters remaining on the partition.
+	std::mutex allocationMutex;								// guards the bitmaps, the free cluster counts, the cursors and changes of the references (never held during I/O)
 
 };
 
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,221 @@
+#ifndef _WIN32
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE												// O_DIRECT
+#endif
+
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "FilePartition.h"
+#include "part.h"
+
+class PartitionImpl {
+
+public:
+
+	PartitionImpl(const char* iniFileName, FilePartition::IOMode mode_) : mode(mode_) {
+
+		std::ifstream iniFile(iniFileName);						// first line: file name, second line: number of clusters (the rest is a comment)
+		std::string fileName;
+		if (!iniFile || !std::getline(iniFile, fileName) || !(iniFile >> numberOfClusters)) {
+			std::cout << "Cannot read partition description " << iniFileName << std::endl;
+			numberOfClusters = 0;
+			return;
+		}
+		if (!fileName.empty() && fileName.back() == '\r') fileName.pop_back();
+
+		int flags = O_RDWR | O_CREAT;
+		if (mode == FilePartition::DIRECT) {
+#ifdef O_DIRECT
+			flags |= O_DIRECT;
+#else
+			mode = FilePartition::PREAD_PWRITE;
+#endif
+		}
+
+		fileDescriptor = open(fileName.c_str(), flags, 0644);
+		if (fileDescriptor < 0 && mode == FilePartition::DIRECT) {	// eg. tmpfs refuses O_DIRECT -- fall back to buffered I/O
+			std::cout << "O_DIRECT not supported for " << fileName << ", using buffered I/O" << std::endl;
+			mode = FilePartition::PREAD_PWRITE;
+			fileDescriptor = open(fileName.c_str(), O_RDWR | O_CREAT, 0644);
+		}
+		if (fileDescriptor < 0) {
+			std::cout << "Cannot open partition file " << fileName << ": " << strerror(errno) << std::endl;
+			numberOfClusters = 0;
+			return;
+		}
+
+		off_t size = (off_t)numberOfClusters * ClusterSize;
+		if (mode == FilePartition::DIRECT)						// whole aligned blocks are transferred, the last one included
+			size = (size + directAlignment - 1) / directAlignment * directAlignment;
+		struct stat fileInfo;
+		if (fstat(fileDescriptor, &fileInfo) == 0 && fileInfo.st_size < size && ftruncate(fileDescriptor, size) != 0) {
+			std::cout << "Cannot resize partition file " << fileName << ": " << strerror(errno) << std::endl;
+			numberOfClusters = 0;
+			return;
+		}
+
+		if (mode == FilePartition::MMAP) {
+			void* address = mmap(nullptr, (size_t)size, PROT_READ | PROT_WRITE, MAP_SHARED, fileDescriptor, 0);
+			if (address == MAP_FAILED) {
+				std::cout << "Cannot map partition file " << fileName << ": " << strerror(errno) << std::endl;
+				mode = FilePartition::PREAD_PWRITE;
+			}
+			else mapping = (char*)address;
+		}
+
+		if (mode == FilePartition::DIRECT && posix_memalign((void**)&alignedBuffer, directAlignment, directAlignment) != 0) {
+			alignedBuffer = nullptr;
+			disableDirect();
+		}
+	}
+
+	~PartitionImpl() {
+		if (mapping) munmap(mapping, (size_t)numberOfClusters * ClusterSize);
+		if (fileDescriptor >= 0) close(fileDescriptor);
+		free(alignedBuffer);
+	}
+
+	int read(ClusterNo cluster, char* buffer) {
+		if (cluster >= numberOfClusters) return 0;
+
+		if (mapping) {
+			memcpy(buffer, mapping + (size_t)cluster * ClusterSize, ClusterSize);
+			return 1;
+		}
+
+		if (mode == FilePartition::DIRECT) {
+			std::lock_guard<std::mutex> guard(directMutex);
+			if (mode == FilePartition::DIRECT) {
+				size_t offsetInBlock = (size_t)cluster * ClusterSize % directAlignment;
+				ssize_t result = readBlock(cluster);
+				if (result == (ssize_t)directAlignment) {
+					memcpy(buffer, alignedBuffer + offsetInBlock, ClusterSize);
+					return 1;
+				}
+				if (result >= 0 || errno != EINVAL) return 0;
+				disableDirect();								// the file system doesn't accept this alignment
+			}
+		}
+
+		return pread(fileDescriptor, buffer, ClusterSize, (off_t)cluster * ClusterSize) == (ssize_t)ClusterSize ? 1 : 0;
+	}
+
+	int write(ClusterNo cluster, const char* buffer) {
+		if (cluster >= numberOfClusters) return 0;
+
+		if (mapping) {
+			memcpy(mapping + (size_t)cluster * ClusterSize, buffer, ClusterSize);
+			return 1;
+		}
+
+		if (mode == FilePartition::DIRECT) {
+			std::lock_guard<std::mutex> guard(directMutex);
+			if (mode == FilePartition::DIRECT) {					// read-modify-write of the block holding the cluster
+				size_t offsetInBlock = (size_t)cluster * ClusterSize % directAlignment;
+				ssize_t result = readBlock(cluster);
+				if (result == (ssize_t)directAlignment) {
+					memcpy(alignedBuffer + offsetInBlock, buffer, ClusterSize);
+					result = pwrite(fileDescriptor, alignedBuffer, directAlignment, (off_t)cluster * ClusterSize - (off_t)offsetInBlock);
+					if (result == (ssize_t)directAlignment) return 1;
+				}
+				if (result >= 0 || errno != EINVAL) return 0;
+				disableDirect();
+			}
+		}
+
+		return pwrite(fileDescriptor, buffer, ClusterSize, (off_t)cluster * ClusterSize) == (ssize_t)ClusterSize ? 1 : 0;
+	}
+
+	static const size_t directAlignment = 4096;					// O_DIRECT transfers whole blocks of this size (4K sector devices included),
+																// a cluster is a part of one
+
+	ClusterNo numberOfClusters = 0;
+	std::atomic<FilePartition::IOMode> mode;					// DIRECT is only left under _directMutex_, read without it
+	int fileDescriptor = -1;
+	char* mapping = nullptr;									// only in MMAP mode
+	char* alignedBuffer = nullptr;								// only in DIRECT mode, one aligned block
+	std::mutex directMutex;										// guards _alignedBuffer_
+
+private:
+
+	ssize_t readBlock(ClusterNo cluster) {						// reads the aligned block holding the cluster into _alignedBuffer_
+		off_t offset = (off_t)cluster * ClusterSize;
+		return pread(fileDescriptor, alignedBuffer, directAlignment, offset - offset % (off_t)directAlignment);
+	}
+
+	void disableDirect() {										// called once (by the constructor, or holding _directMutex_)
+		std::cout << "O_DIRECT rejected by the file system, using buffered I/O" << std::endl;
+		mode = FilePartition::PREAD_PWRITE;
+#ifdef O_DIRECT
+		fcntl(fileDescriptor, F_SETFL, fcntl(fileDescriptor, F_GETFL) & ~O_DIRECT);
+#endif
+	}
+
+};
+
+// Partition is otherwise provided by part.lib -- natively it uses the pread()/pwrite() backend.
+// FilePartition passes nullptr and keeps its own backend.
+
+Partition::Partition(const char* iniFileName) {
+	myImpl = iniFileName ? new PartitionImpl(iniFileName, FilePartition::PREAD_PWRITE) : nullptr;
+}
+
+ClusterNo Partition::getNumOfClusters() const {
+	return myImpl ? myImpl->numberOfClusters : 0;
+}
+
+int Partition::readCluster(ClusterNo cluster, char* buffer) {
+	return myImpl ? myImpl->read(cluster, buffer) : 0;
+}
+
+int Partition::writeCluster(ClusterNo cluster, const char* buffer) {
+	return myImpl ? myImpl->write(cluster, buffer) : 0;
+}
+
+Partition::~Partition() {
+	delete myImpl;
+}
+
+FilePartition::FilePartition(const char* iniFileName, IOMode mode) : Partition(nullptr) {
+	backend = new PartitionImpl(iniFileName, mode);
+}
+
+FilePartition::~FilePartition() {
+	delete backend;
+}
+
+ClusterNo FilePartition::getNumOfClusters() const {
+	return backend->numberOfClusters;
+}
+
+int FilePartition::readCluster(ClusterNo cluster, char* buffer) {
+	return backend->read(cluster, buffer);
+}
+
+int FilePartition::writeCluster(ClusterNo cluster, const char* buffer) {
+	return backend->write(cluster, buffer);
+}
+
+FilePartition::IOMode FilePartition::getMode() const {
+	return backend->mode;
+}
+
+char* FilePartition::getMappedCluster(ClusterNo cluster) {
+	if (!backend->mapping || cluster >= backend->numberOfClusters) return nullptr;
+	return backend->mapping + (size_t)cluster * ClusterSize;
+}
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef _filepartition_h_
+
+#define _filepartition_h_
+
+#include "part.h"
+
+// Native partition for POSIX hosts. Reads the same ini file as the course partition
+// (name of the backing file in the first line, number of clusters in the second)
+// and keeps cluster _n_ at offset n * ClusterSize of the backing file.
+
+class FilePartition : public Partition {
+
+public:
+
+	enum IOMode {
+		PREAD_PWRITE,											// every cluster access is a pread()/pwrite() system call
+		MMAP,													// the file is mapped, clusters are copied with memcpy()
+		DIRECT													// pread()/pwrite() with O_DIRECT of the aligned 4K block holding the cluster (bypasses the page
+																// cache), falls back to PREAD_PWRITE with a message if the file system refuses it
+	};
+
+	FilePartition(const char* iniFileName, IOMode mode = PREAD_PWRITE);
+	virtual ~FilePartition();
+
+	virtual ClusterNo getNumOfClusters() const;
+
+	virtual int readCluster(ClusterNo cluster, char* buffer);
+	virtual int writeCluster(ClusterNo cluster, const char* buffer);
+
+	IOMode getMode() const;										// may differ from the requested mode if O_DIRECT isn't supported
+	char* getMappedCluster(ClusterNo cluster);					// address of the cluster in the mapping, nullptr if the mode isn't MMAP
+
+private:
+
+	PartitionImpl* backend;
+
+};
+
+
+#endif
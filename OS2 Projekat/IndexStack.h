@@ -0,0 +1,57 @@
+#ifndef _indexstack_h_
+#define _indexstack_h_
+
+#include <atomic>
+#include <cstdint>
+
+// A lock-free stack (Treiber stack) of the indices 0 .. capacity - 1, used for the free block and free PMT slot lists.
+// The head holds the index on top together with a tag that changes with every push and pop, so a pop that has read
+// a head which was popped and pushed back meanwhile fails its compare and swap instead of corrupting the stack (ABA).
+// The links are kept in an array of their own, the entries themselves (free blocks and slots) are never written to.
+
+class IndexStack {
+public:
+
+	static const std::uint32_t empty = (std::uint32_t)-1;					// returned by pop() when there's nothing on the stack
+
+	IndexStack(std::uint32_t capacity, bool full) {							// a full stack pops 0, 1, 2 ... first
+		next = new std::atomic<std::uint32_t>[capacity];
+		for (std::uint32_t i = 0; i < capacity; i++)
+			next[i].store(full && i + 1 < capacity ? i + 1 : empty, std::memory_order_relaxed);
+		head.store(pack(0, full && capacity ? 0 : empty));
+	}
+
+	~IndexStack() { delete[] next; }
+
+	void push(std::uint32_t index) {
+		std::uint64_t oldHead = head.load(std::memory_order_relaxed);
+		do {
+			next[index].store((std::uint32_t)oldHead, std::memory_order_relaxed);	// published by the release below
+		} while (!head.compare_exchange_weak(oldHead, pack(tagOf(oldHead) + 1, index), std::memory_order_release, std::memory_order_relaxed));
+	}
+
+	std::uint32_t pop() {
+		std::uint64_t oldHead = head.load(std::memory_order_acquire);
+		for (;;) {
+			std::uint32_t top = (std::uint32_t)oldHead;
+			if (top == empty) return empty;
+																			// _next_ may be stale if _top_ was taken meanwhile, the tag then differs
+			std::uint64_t newHead = pack(tagOf(oldHead) + 1, next[top].load(std::memory_order_relaxed));
+			if (head.compare_exchange_weak(oldHead, newHead, std::memory_order_acquire, std::memory_order_acquire))
+				return top;
+		}
+	}
+
+private:
+
+	static std::uint64_t pack(std::uint32_t tag, std::uint32_t index) { return ((std::uint64_t)tag << 32) | index; }
+	static std::uint32_t tagOf(std::uint64_t packed) { return (std::uint32_t)(packed >> 32); }
+
+	std::atomic<std::uint64_t> head;										// tag (high half) and the index on top (low half)
+	std::atomic<std::uint32_t>* next;										// next[i] is the index below _i_ while _i_ is on the stack
+
+	IndexStack(const IndexStack&) = delete;
+	IndexStack& operator=(const IndexStack&) = delete;
+};
+
+#endif
@@ -2,6 +2,10 @@
 
 #define _kernelprocess_h_
 
+#include <atomic>
+#include <cstddef>
+#include <map>
+#include <mutex>
 #include <vector>
 #include "KernelSystem.h"
 #include "vm_declarations.h"
@@ -14,6 +18,9 @@ public:
 
 	~KernelProcess();
 
+	static void* operator new(std::size_t size);		// kernel process objects are pooled (see ObjectPool.h)
+	static void operator delete(void* object, std::size_t size);
+
 	ProcessId getProcessId() const { return id; }
 
 	Status createSegment(VirtualAddress startAddress, PageNum segmentSize,
@@ -27,7 +34,8 @@ public:
 
 	void blockIfThrashing();
 
-	Process* clone(ProcessId pid);
+	Process* clone();														// the system picks the clone's ID (its process table slot)
+	Process* clone(ProcessId pid, const std::vector<unsigned short>& pmt2Entries);	// _pmt2Entries_ are the PMT1 entries in use, found by the caller
 	Status createSharedSegment(VirtualAddress startAddress,
 		PageNum segmentSize, const char* name, AccessType flags);
 	Status disconnectSharedSegment(const char* name);
@@ -38,11 +46,11 @@ private:
 
 	bool inconsistencyCheck(VirtualAddress startAddress, PageNum segmentSize);
 	bool inconsistentAddressCheck(VirtualAddress startAddress);
-																			// Deletes a segment and skips several checks present in the user deleteSegment() method.
-	Status optimisedDeleteSegment(SegmentInfo* segment, bool checkIndex, unsigned index);
 
 	void releaseMemoryAndDisk(SegmentInfo* segment);						// Releases everything reserved by the given segment. Used in the delete methods.
 
+	Status loadPage(VirtualAddress address, bool& outOfSpace);				// pageFault() with the process locked, _outOfSpace_ is set if no frame could be had
+
 
 	unsigned concatenatePageParts(unsigned short page1, unsigned short page2);
 
@@ -53,30 +61,32 @@ private:
 		VirtualAddress startAddress;					// start address in virtual space
 		AccessType accessType;							// the access type for the segment that the process declared would use
 		PageNum length = 0;								// each segment's length (in blocks required)
-		KernelSystem::PMT2Descriptor* firstDescAddress;	// address of the first descriptor (from this point onwards for _length_ descriptors)
-		std::string sharedSegmentName = "";				// if this segment is shared, remember the name of the shared segment 
+		KernelSystem::SharedSegmentHandle sharedSegment = KernelSystem::noSharedSegment;	// if this segment is shared, the handle of the shared segment
+		unsigned sharerIndex = 0;						// and the segment's place in the shared segment's sharer list
 
-		SegmentInfo(VirtualAddress startAddr, AccessType access, PageNum newLength, KernelSystem::PMT2Descriptor* descriptorAddress) :
-			startAddress(startAddr), accessType(access), length(newLength), firstDescAddress(descriptorAddress) {}
+		SegmentInfo(VirtualAddress startAddr, AccessType access, PageNum newLength) :
+			startAddress(startAddr), accessType(access), length(newLength) {}
 
 		~SegmentInfo() {}
 	};
 
-	std::vector<SegmentInfo> segments;					// current segment list
+	typedef std::map<VirtualAddress, SegmentInfo> SegmentMap;
+	SegmentMap segments;								// current segments, by start address (they never overlap)
+
+	SegmentMap::iterator findSegment(VirtualAddress address);	// the segment holding _address_, segments.end() if there's none
+														// Deletes a segment and skips several checks present in the user deleteSegment() method.
+	void optimisedDeleteSegment(SegmentMap::iterator segment);
 	ProcessId id;										// process & parent id
 	KernelSystem* system;								// the system this process is being run on, set in system's createProcess()
 	KernelSystem::PMT1* PMT1;							// page map table pointer of the first level, set in system's createProcess()
 
-	bool shouldBlockFlag = false;						// if this flag is true and this process calls blockIfThrashing() it will be blocked
+	std::atomic<bool> shouldBlockFlag{ false };			// if this flag is true and this process calls blockIfThrashing() it will be blocked
 
-	struct CloningPMTRequest {							// Kernel System fills the request vector up with structs of this type
-		unsigned short originalPMT1Entry;
-		bool shouldMakeCloningPMT2 = false;
-
-		CloningPMTRequest(unsigned short pmt1entry)	: originalPMT1Entry(pmt1entry) {}
-	};
+	std::mutex pageTableMutex;							// guards the PMT1 while the system's structure lock is only shared (see KernelSystem's LOCK ORDER)
 
-	std::vector<CloningPMTRequest> cloningPMTRequests;
+	static const PageNum noCopyOnWritePage = (PageNum)-1;
+	PageNum copyOnWritePage = noCopyOnWritePage;		// page whose write access() refused because it must be copied first, the next
+														// pageFault() on it makes the copy (guarded by pageTableMutex)
 
 	friend class System;
 	friend class KernelSystem;
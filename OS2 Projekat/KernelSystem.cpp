@@ -1,8 +1,10 @@
 #include <algorithm>
 #include <iterator>
 #include <mutex>
-#include <cmath>
+#include <cstring>
+#include <new>
 #include <string>
+#include <thread>
 
 #include "DiskManager.h"
 #include "KernelSystem.h"
@@ -13,7 +15,12 @@
 #include "vm_declarations.h"
 
 KernelSystem::KernelSystem(PhysicalAddress processVMSpace_, PageNum processVMSpaceSize_,
-	PhysicalAddress pmtSpace_, PageNum pmtSpaceSize_, Partition* partition_) {
+	PhysicalAddress pmtSpace_, PageNum pmtSpaceSize_, Partition* partition_)
+	: KernelSystem(processVMSpace_, processVMSpaceSize_, pmtSpace_, pmtSpaceSize_, &partition_, 1, ROUND_ROBIN) {}
+
+KernelSystem::KernelSystem(PhysicalAddress processVMSpace_, PageNum processVMSpaceSize_,
+	PhysicalAddress pmtSpace_, PageNum pmtSpaceSize_,
+	Partition** partitions, unsigned short numberOfPartitions, StripingPolicy policy) {
 
 	processVMSpace = processVMSpace_;										// initialise info about physical blocks
 	processVMSpaceSize = processVMSpaceSize_;
@@ -21,67 +28,72 @@ KernelSystem::KernelSystem(PhysicalAddress processVMSpace_, PageNum processVMSpa
 	pmtSpace = pmtSpace_;													// initialise info about PMT blocks 
 	pmtSpaceSize = pmtSpaceSize_;
 
-	freeBlocksHead = processVMSpace_;										// assign head pointers
-	freePMTSlotHead = pmtSpace_;
+																			// slots start at multiples of their size (a descriptor finds its PMT2 from its own address)
+	uintptr_t slotOffset = (pmtSlotSize - (uintptr_t)pmtSpace_ % pmtSlotSize) % pmtSlotSize;
+	pmtSlotsStart = (PhysicalAddress)((char*)pmtSpace_ + slotOffset);
 
 	referenceRegisters = new ReferenceRegister[processVMSpaceSize];			// create reference registers
 
-	diskManager = new DiskManager(partition_);								// create the manager for the partition
+	diskManager = new DiskManager(partitions, numberOfPartitions, policy);	// create the manager for the partitions (swap is striped across them)
 
-	this->numberOfFreePMTSlots = pmtSpaceSize;
-																			// initialise lists
-	unsigned* blocksTemp = (unsigned*)freeBlocksHead, *pmtTemp = (unsigned*)freePMTSlotHead;
-	for (PageNum i = 0; i < (processVMSpaceSize <= pmtSpaceSize ? pmtSpaceSize : processVMSpaceSize); i++) {
-		if (i < processVMSpaceSize) {										// block list
-			if (i == processVMSpaceSize - 1) {
-				*blocksTemp = 0;
-			}
-			else {
-				*blocksTemp = (unsigned)((char*)blocksTemp + 1024);
-				blocksTemp = (unsigned*)((char*)blocksTemp + 1024);
-			}
-		}
-		if (i < pmtSpaceSize) {
-			if (i == pmtSpaceSize - 1) {									// PMT slot list
-				*pmtTemp = 0;
-			}
-			else {
-				*pmtTemp = (unsigned)((char*)pmtTemp + 1024);
-				pmtTemp = (unsigned*)((char*)pmtTemp + 1024);
-			}
-		}
-	}
+																			// a slot spans several pages if a PMT doesn't fit into one (64-bit builds)
+	PageNum numberOfPMTSlots = slotOffset < (uintptr_t)pmtSpaceSize * PAGE_SIZE ? (PageNum)(((uintptr_t)pmtSpaceSize * PAGE_SIZE - slotOffset) / pmtSlotSize) : 0;
+	this->numberOfFreePMTSlots = numberOfPMTSlots;
+	this->numberOfFreeBlocks = processVMSpaceSize;
+
+	freeBlocks = new IndexStack((std::uint32_t)processVMSpaceSize, true);	// everything is free, handed out from the lowest address up
+	freePMTSlots = new IndexStack((std::uint32_t)numberOfPMTSlots, true);
+	cleanPMT1Slots = new IndexStack((std::uint32_t)numberOfPMTSlots, false);
+	pmtSlotInfo = new PMTSlotInfo[numberOfPMTSlots];
 
+	processTableSize = (std::uint32_t)(numberOfPMTSlots < processSlotMask ? numberOfPMTSlots : processSlotMask);
+	processTable = new ProcessSlot[processTableSize];
+	for (std::uint32_t slot = 0; slot < processTableSize; slot++)			// the first process gets ID 0, like it always has
+		processTable[slot].pid = slot;
+	freeProcessSlots = new IndexStack(processTableSize, true);
+
+	reclaimer = std::thread(reclaimWorker, this);
 }
 
 KernelSystem::~KernelSystem() {
 
+	reclaimMutex.lock();													// stop the reclaimer, pending PMT2s go away with the PMT space
+	stopReclaimer = true;
+	reclaimMutex.unlock();
+	reclaimCondition.notify_one();
+	reclaimer.join();
+
 	delete[] referenceRegisters;
 	delete diskManager;
+	delete freeBlocks;
+	delete freePMTSlots;
+	delete cleanPMT1Slots;
+	delete[] pmtSlotInfo;
+	delete[] processTable;
+	delete freeProcessSlots;
 }
 
 Process* KernelSystem::createProcess() {
 
 	mutex.lock();
 
-	if (!numberOfFreePMTSlots) { mutex.unlock(); return nullptr; }			// no space for a new PMT1 at the moment
+	if (!hasAvailablePMTSlots(1)) { mutex.unlock(); return nullptr; }			// no space for a new PMT1 at the moment
+
+	ProcessId pid = takeProcessID();
+	if (pid == noProcessID) { mutex.unlock(); return nullptr; }				// the process table is full
 
-	Process* newProcess = new Process(processIDGenerator++);
+	Process* newProcess = new Process(pid);
 
 	newProcess->pProcess->system = this;
 
-	newProcess->pProcess->PMT1 = (PMT1*)getFreePMTSlot();					// grab a free PMT slot for the PMT1
+	newProcess->pProcess->PMT1 = getFreePMT1();								// grab a free PMT slot for the PMT1 (all of its pointers are nullptr)
 	if (!newProcess->pProcess->PMT1) {
+		mutex.unlock();														// the process's destructor takes the lock itself
 		delete newProcess;
-		mutex.unlock();
 		return nullptr;														// this exception should never occur
 	}
 
-	for (unsigned short i = 0; i < PMT1Size; i++) {							// initialise all of its pointers to nullptr
-		(*(newProcess->pProcess->PMT1))[i] = nullptr;
-	}
-																			// add the new process to the hash map
-	activeProcesses.insert(std::pair<ProcessId, Process*>(processIDGenerator - 1, newProcess));
+	registerProcess(newProcess);											// add the new process to the process table
 
 	// do other things if needed
 
@@ -90,193 +102,259 @@ Process* KernelSystem::createProcess() {
 	return newProcess;
 }
 
-Time KernelSystem::periodicJob() {											// shift reference bit into reference bits
+Time KernelSystem::periodicJob() {											// move the referenced pages into the youngest generation
+
+	mutex.lock_shared();													// pages keep being faulted in meanwhile, each frame is locked while it's aged
+	agingMutex.lock();
 
-	for (PageNum i = 0; i < processVMSpaceSize; i++) {						// shift each reference bit into that block's register
-		if (referenceRegisters[i].pageDescriptor) {							// only if there is a page in that block slot
-			referenceRegisters[i].value >>= 1;
-			referenceRegisters[i].value |= (referenceRegisters[i].pageDescriptor->getReferenced() ? 1U : 0U) << (sizeof(unsigned) * 8 - 1);
-			if (referenceRegisters[i].pageDescriptor->getReferenced())
-				referenceRegisters[i].pageDescriptor->resetReferenced();
+	PageNum sliceSize = processVMSpaceSize < agingSliceSize ? processVMSpaceSize : agingSliceSize;
+	bool passCompleted = false;
+
+	for (PageNum n = 0; n < sliceSize; n++) {								// look at each block's reference bits (a slice of the blocks per call)
+		ReferenceRegister& blockReg = referenceRegisters[agingCursor];
+		blockReg.mutex.lock();
+		if (!blockReg.mappings.empty() && takeReferencedBits(blockReg))		// only if there is a page in that block slot
+			moveToGeneration(blockReg, youngestGeneration);
+		blockReg.mutex.unlock();
+
+		if (++agingCursor == processVMSpaceSize) {
+			agingCursor = 0;
+			passCompleted = true;
 		}
 	}
+																			// the pages referenced during the pass stay in the generation that was
+	unsigned youngest = youngestGeneration;									// the youngest, the next pass fills a new one
+	if (passCompleted && youngest - oldestGeneration + 1 < numberOfGenerations)
+		youngestGeneration.compare_exchange_strong(youngest, youngest + 1);	// (eviction may open one as well)
+																			// more than one fault per 8 aged frames with memory full -- age faster,
+	unsigned pageFaults = pageFaultsSinceAging.exchange(0);					// so the victims are chosen from more recent history
+	if (!hasFreeBlocks() && pageFaults > sliceSize / 8)
+		agingPeriod = agingPeriod / 2 > minimumAgingPeriod ? agingPeriod / 2 : minimumAgingPeriod;
+	else if (pageFaults <= sliceSize / 32)
+		agingPeriod = agingPeriod * 2 < maximumAgingPeriod ? agingPeriod * 2 : maximumAgingPeriod;
+
+	Time sliceTime = (Time)(agingPeriod * sliceSize / (processVMSpaceSize ? processVMSpaceSize : 1));
+
+	agingMutex.unlock();
+	bool deduplicate = deduplicationEnabled && passCompleted;
+	mutex.unlock_shared();
+
+	if (deduplicate) {
+		mutex.lock();														// merging pages changes the page tables of several processes
+		if (deduplicationEnabled && ++deduplicationTickCounter == deduplicationPeriod) {
+			deduplicationTickCounter = 0;									// every _deduplicationPeriod_ passes look for identical pages
+			deduplicatePages();
+		}
+		mutex.unlock();
+	}
 
-	return 100;																// 100ms period
+	return sliceTime ? sliceTime : 1;										// the whole pass takes _agingPeriod_ (100ms without memory pressure)
 
 }
 
+void KernelSystem::setDeduplication(bool enabled) {
+	mutex.lock();
+	deduplicationEnabled = enabled;
+	deduplicationTickCounter = 0;
+	mutex.unlock();
+}
+
+DeduplicationStatistics KernelSystem::getDeduplicationStatistics() {
+	mutex.lock_shared();
+	DeduplicationStatistics statistics = deduplicationStatistics;
+	mutex.unlock_shared();
+	return statistics;
+}
+
+ReplacementStatistics KernelSystem::getReplacementStatistics() {
+	ReplacementStatistics statistics;										// the counters are updated lock-free, they may be a fault apart
+	statistics.evictions = evictions;
+	statistics.refaults = refaults;
+	statistics.shortRefaults = shortRefaults;
+	statistics.refaultDistanceSum = refaultDistanceSum;
+	unsigned oldest = oldestGeneration;
+	statistics.generations = youngestGeneration - oldest + 1;
+	return statistics;
+}
+
 
 Status KernelSystem::access(ProcessId pid, VirtualAddress address, AccessType type) {
 
-	mutex.lock();
+	mutex.lock_shared();													// accesses of other processes aren't held up
 
-	Process* wantedProcess = nullptr;
-	try {
-		wantedProcess = activeProcesses.at(pid);							// check for the key but don't insert if nonexistant 
-	}																		// (that is what unordered_map::operator[] would do)
-	catch (std::out_of_range noProcessWithPID) {
+	Process* wantedProcess = findProcess(pid);
+	if (!wantedProcess) {
 		consecutivePageFaultsCounter = 0;									// reset page fault counter
-		mutex.unlock();
+		mutex.unlock_shared();
 		return TRAP;
 	}
 
-	PMT2Descriptor* pageDescriptor = getPageDescriptor(wantedProcess->pProcess, address);
-	if (!pageDescriptor) {
-		if (!freeBlocksHead) {												// only count page faults if all physical blocks are full
-			consecutivePageFaultsCounter++;
-			if (consecutivePageFaultsCounter == pageFaultLimitNumber) {		// set flag if limit is reached
-				consecutivePageFaultsCounter = 0;
-				wantedProcess->pProcess->shouldBlockFlag = true;
-				mutex.unlock();
-				return TRAP;												// alert the system
-			}
-		}
-		mutex.unlock();
-		return PAGE_FAULT;													// if PMT2 isn't created
-	}
+	KernelProcess* process = wantedProcess->pProcess;
+	process->pageTableMutex.lock();
+
+	Status status = accessPage(process, address, type);
+
+	process->pageTableMutex.unlock();
+	mutex.unlock_shared();
+	return status;
+}
+
+Status KernelSystem::accessPage(KernelProcess* process, VirtualAddress address, AccessType type) {
+
+	PMT2Descriptor* pageDescriptor = getPageDescriptor(process, address);
+	if (!pageDescriptor) return countPageFault(process);					// if PMT2 isn't created
+
+	PMT2* pmt2 = pageDescriptor->getTable();
+	pmt2->mutex.lock();
 
 	if (!pageDescriptor->getInUse()) {
 		consecutivePageFaultsCounter = 0;									// reset page fault counter
-		mutex.unlock();
+		pmt2->mutex.unlock();
 		return TRAP;														// attempted access of address that doesn't belong to any segment
 	}
-	
-	if (pageDescriptor->getCloned()) {										// if the page is currently cloned, check if it's an attempt to write
-		if (type == WRITE || type == READ_WRITE) {							// if it's a write attempt, the page must first be copied
-			processesAttemptingCopyOnWrite.push_back(pid);
-			mutex.unlock();
-			return PAGE_FAULT;
-		}
-		else
-			pageDescriptor = (PMT2Descriptor*)pageDescriptor->getBlock();	// move on to the cloning PMT2 and the adequate descriptor in there
-	}
+																			// a write into a PMT2 shared with a clone first needs a private copy of the table
+	bool tableShared = !pageDescriptor->getShared() && isPMT2Shared(pmt2);
 
-	if (pageDescriptor->getShared())										// if this page is of a shared segment, switch to the appropriate descriptor
+	PMT2* sharedSegmentPMT2 = nullptr;
+	if (pageDescriptor->getShared()) {										// if this page is of a shared segment, switch to the appropriate descriptor
 		pageDescriptor = (PMT2Descriptor*)pageDescriptor->getBlock();
-
-	if (!pageDescriptor->getV()) {											// the page isn't loaded in memory -- return page fault
-		if (!freeBlocksHead) {												// only count page faults if all physical blocks are full
-			consecutivePageFaultsCounter++;
-			if (consecutivePageFaultsCounter == pageFaultLimitNumber) {		// set flag if limit is reached
-				consecutivePageFaultsCounter = 0;
-				wantedProcess->pProcess->shouldBlockFlag = true;
-				mutex.unlock();
-				return TRAP;												// alert the system
-			}
-		}
-		mutex.unlock();
-		return PAGE_FAULT;
+		sharedSegmentPMT2 = pageDescriptor->getTable();
+		sharedSegmentPMT2->mutex.lock();
 	}
+
+	Status status = OK;
+	ReferenceRegister* frame = lockResidentPage(pageDescriptor);
+
+	if (!frame) status = countPageFault(process);							// the page isn't loaded in memory -- return page fault
 	else {
 		pageDescriptor->setReferenced();									// the page has been accessed in this period -- set the ref bit
 
 		switch (type) {														// check access rights
 		case READ:
-			if (!pageDescriptor->getRd()) { consecutivePageFaultsCounter = 0; mutex.unlock(); return TRAP; }
+			if (!pageDescriptor->getRd()) status = TRAP;
 			break;
 		case WRITE:
-			if (!pageDescriptor->getWr()) { consecutivePageFaultsCounter = 0; mutex.unlock(); return TRAP; }
-			pageDescriptor->setD();											// indicate that the page is dirty
+			if (!pageDescriptor->getWr()) status = TRAP;
+			else if (tableShared || pageDescriptor->getCopyOnWrite()) {		// the page must first be copied (resolved in pageFault())
+				process->copyOnWritePage = address >> wordPartBitLength;
+				status = PAGE_FAULT;
+			}
+			else setDirty(pageDescriptor);									// indicate that the page is dirty
 			break;
 		case READ_WRITE:
-			if (!pageDescriptor->getRd() || !pageDescriptor->getWr()) { consecutivePageFaultsCounter = 0; mutex.unlock(); return TRAP; }
+			if (!pageDescriptor->getRd() || !pageDescriptor->getWr()) status = TRAP;
+			else if (tableShared || pageDescriptor->getCopyOnWrite()) {
+				process->copyOnWritePage = address >> wordPartBitLength;
+				status = PAGE_FAULT;
+			}
+			else setDirty(pageDescriptor);
 			break;
 		case EXECUTE:
-			if (!pageDescriptor->getEx()) { consecutivePageFaultsCounter = 0; mutex.unlock(); return TRAP; }
+			if (!pageDescriptor->getEx()) status = TRAP;
 			break;
 		}
 
-		consecutivePageFaultsCounter = 0;									// if the page is in memory, access doesn't return page fault so the counter can be reset
-		mutex.unlock();
-		return OK;															// page is in memory and the operation is allowed
+		if (status != PAGE_FAULT) consecutivePageFaultsCounter = 0;		// a page in memory was reached (or the access was refused)
+		frame->mutex.unlock();
 	}
+
+	if (sharedSegmentPMT2) sharedSegmentPMT2->mutex.unlock();
+	pmt2->mutex.unlock();
+	return status;															// OK if the page is in memory and the operation is allowed
+}
+
+Status KernelSystem::countPageFault(KernelProcess* process) {
+
+	pageFaultsSinceAging++;													// the aging speeds up while pages keep being faulted in
+	if (!hasFreeBlocks()) {													// only count page faults if all physical blocks are full
+		if (++consecutivePageFaultsCounter == pageFaultLimitNumber) {		// set flag if limit is reached
+			consecutivePageFaultsCounter = 0;
+			process->shouldBlockFlag = true;
+			return TRAP;													// alert the system
+		}
+	}
+	return PAGE_FAULT;
 }
 
 Process* KernelSystem::cloneProcess(ProcessId pid) {
 	mutex.lock();
 
-	Process* wantedProcess = nullptr;										// try and find target process for cloning
-	try {
-		wantedProcess = activeProcesses.at(pid);							// check for the key but don't insert if nonexistant 
-	}																		// (that is what unordered_map::operator[] would do)
-	catch (std::out_of_range noProcessWithPID) {
+	Process* wantedProcess = findProcess(pid);								// try and find target process for cloning
+	if (!wantedProcess) {
 		mutex.unlock();
 		return nullptr;
 	}
 
-																			// memory and disk are shared until one of the processes performs a write (copy on write technique)
-
-	PageNum spaceToReplicateProcess = 1;									// 1xPMT1
-	for (unsigned short i = 0; i < PMT1Size; i++)							// count PMT2s
-		if ((*(wantedProcess->pProcess->PMT1))[i] != nullptr)
-			spaceToReplicateProcess++;
-
-	if (spaceToReplicateProcess > numberOfFreePMTSlots) {					// if there's no space already, return
+																			// the clone gets a PMT1 pointing to the original's PMT2s, a PMT2 is only copied
+																			// once one of the processes changes it (copy on write for the page tables as well)
+	std::vector<unsigned short> pmt2Entries;
+	PageNum pmt2Copies = 0;
+	for (unsigned short i = 0; i < PMT1Size; i++) {							// find the PMT2s
+		PMT2* pmt2 = (*(wantedProcess->pProcess->PMT1))[i];
+		if (!pmt2) continue;
+		pmt2Entries.push_back(i);
+		if (!isSharedSegmentPMT2(pmt2)) pmt2Copies++;						// shared segment PMT2s mapped directly are never copied
+	}
+																			// 1xPMT1 now + a slot reserved for each PMT2's future copy
+	if (!hasAvailablePMTSlots(1 + pmt2Copies)) {								// if there's no space, return
 		mutex.unlock();
 		return nullptr;														// surely insufficient number of slots in PMT memory
 	}
+	ProcessId clonePID = takeProcessID();
+	if (clonePID == noProcessID) {
+		mutex.unlock();
+		return nullptr;														// the process table is full
+	}
+																			// There is enough space to perform cloning
+	Process* clonedProcess = wantedProcess->pProcess->clone(clonePID, pmt2Entries);
 
-	// check space for every segment -- ignore shared segments, ignore those with cloned = 1, need to count PMT2 that has some shared some non shared
-	// also need to count those without any shared
-
-	// three types of PMT2 when counting for cloning:
-	// 1) all pages in the PMT2 have cloned = 0						  ==> a cloning PMT2 must be made
-	// 2) some pages link to shared/cloningPMT2, some have cloned = 0 ==> a cloning PMT2 must be made
-	// 3) all pages link to a shared segment or cloning PMT2		  ==> no need to clone, just link (and add to shared segment process list if it's a shared seg)
-
-	PMT1* pmt1 = wantedProcess->pProcess->PMT1;
-	enum PMTType { NO_LINKS, SOME_LINKS, ALL_LINKS };
-
-	for (unsigned short i = 0; i < PMT1Size; i++) {							// check if there is enough space to create the cloning PMT2s (if they are needed)
-		PMT2* pmt2 = (*pmt1)[i];
-		if (pmt2 != nullptr) {												// if a pmt2 exists, check to which type it belongs
-			PMTType pmt2Type;
-			unsigned short descriptorsInUseNumber = 0;
-			unsigned short descriptorsWithCloned0 = 0;
-			unsigned short descriptorsWithShared1 = 0;
-			unsigned short descriptorsWithCloned1 = 0;
-
-			for (unsigned short j = 0; j < PMT2Size; j++) {
-				PMT2Descriptor* descriptor = &((*pmt2)[j]);
-				if (descriptor->getInUse()) {								// only observe the page descriptor if it is in use
-					descriptorsInUseNumber++;
+	mutex.unlock();
+	return clonedProcess;
+}
 
-					if (descriptor->getCloned())
-						descriptorsWithCloned1++;
-					else
-						descriptorsWithCloned0++;
+std::vector<Process*> KernelSystem::cloneProcessN(ProcessId pid, unsigned n) {
+	mutex.lock();
 
-					if (descriptor->getShared())
-						descriptorsWithShared1++;
-				}
-			}
+	std::vector<Process*> clonedProcesses;
 
-			KernelProcess::CloningPMTRequest newRequest(i);					// make a new request as this PMT2 wasn't nullptr
-			if (descriptorsInUseNumber == descriptorsWithCloned1 + descriptorsWithShared1)
-				pmt2Type = ALL_LINKS;
-			else if (descriptorsWithCloned0 > 0 && (descriptorsWithCloned1 > 0 || descriptorsWithShared1 > 0))
-				pmt2Type = SOME_LINKS;
-			else
-				pmt2Type = NO_LINKS;
-
-			if (pmt2Type != ALL_LINKS) {
-				spaceToReplicateProcess++;
-				newRequest.shouldMakeCloningPMT2 = true;					// set that a cloning PMT2 should be made
-			}
+	Process* wantedProcess = findProcess(pid);								// try and find target process for cloning
+	if (!wantedProcess) {
+		mutex.unlock();
+		return clonedProcesses;
+	}
 
-			wantedProcess->pProcess->cloningPMTRequests.push_back(newRequest);
-		}
+	std::vector<unsigned short> pmt2Entries;								// the original is only scanned once for all of the clones
+	PageNum pmt2Copies = 0;
+	for (unsigned short i = 0; i < PMT1Size; i++) {
+		PMT2* pmt2 = (*(wantedProcess->pProcess->PMT1))[i];
+		if (!pmt2) continue;
+		pmt2Entries.push_back(i);
+		if (!isSharedSegmentPMT2(pmt2)) pmt2Copies++;
 	}
 
-	if (spaceToReplicateProcess > numberOfFreePMTSlots) {					// if there's no space now, return
+	if (!hasAvailablePMTSlots((PageNum)n * (1 + pmt2Copies))) {
 		mutex.unlock();
-		return nullptr;														// surely insufficient number of slots in PMT memory
+		return clonedProcesses;												// either all n clones are made or none
 	}
 
-	Process* clonedProcess = wantedProcess->clone(processIDGenerator++);	// There is enough space to perform cloning
+	std::vector<ProcessId> clonePIDs;
+	clonePIDs.reserve(n);
+	for (unsigned i = 0; i < n; i++) {
+		clonePIDs.push_back(takeProcessID());
+		if (clonePIDs.back() == noProcessID) {								// the process table is full
+			clonePIDs.pop_back();
+			for (ProcessId clonePID : clonePIDs) releaseProcessID(clonePID);
+			mutex.unlock();
+			return clonedProcesses;
+		}
+	}
+
+	clonedProcesses.reserve(n);
+	for (ProcessId clonePID : clonePIDs)
+		clonedProcesses.push_back(wantedProcess->pProcess->clone(clonePID, pmt2Entries));
 
 	mutex.unlock();
-	return clonedProcess;
+	return clonedProcesses;
 }
 
 // private methods
@@ -301,538 +379,896 @@ KernelSystem::PMT2Descriptor* KernelSystem::getPageDescriptor(const KernelProces
 KernelSystem::PMT2Descriptor* KernelSystem::allocateDescriptors(KernelProcess* process, VirtualAddress startAddress,
 	PageNum segmentSize, AccessType flags, bool load, void* content) {
 
-	mutex.lock();
-
-	struct EntryCreationHelper {													// helper struct for transcation reasons
-		unsigned short pmt1Entry;													// entry in pmt1
-		unsigned short pmt2Entry;													// entry in pmt2
-	};
-
-	std::vector<unsigned short> missingPMT2s;										// remember indices of PMT2 tables that need to be allocated
-	std::vector<EntryCreationHelper> entries;										// contains info of all pages that will be loaded
-
-	for (PageNum i = 0; i < segmentSize; i++) {										// document PMT2 descriptors
-		VirtualAddress blockVirtualAddress = startAddress + i * PAGE_SIZE;
-		EntryCreationHelper entry;													// extract relevant parts of the address
-
-		entry.pmt1Entry = KernelSystem::extractPage1Part(blockVirtualAddress);
-		entry.pmt2Entry = KernelSystem::extractPage2Part(blockVirtualAddress);
-
-		entries.push_back(entry);
-
-		PMT2* pmt2 = (*(process->PMT1))[entry.pmt1Entry];			     			// access the PMT2 pointer
-		if (!pmt2 && !std::binary_search(missingPMT2s.begin(), missingPMT2s.end(), entry.pmt1Entry)) {
-			missingPMT2s.push_back(entry.pmt1Entry);								// if that pmt2 table doesn't exist yet, add it to the miss list
-			if (missingPMT2s.size() > numberOfFreePMTSlots) {
-				mutex.unlock();
-				return nullptr;														// surely insufficient number of slots in PMT memory
+	if (segmentSize == 0) return nullptr;
+
+	if (!hasAvailablePMTSlots(countMissingPMT2s(process, startAddress, segmentSize)))
+		return nullptr;																// surely insufficient number of slots in PMT memory
+
+	ClusterNo extentStart = DiskManager::noCluster, previousCluster = DiskManager::noCluster;
+																					// the loaded segment is split into one contiguous extent per partition
+	PageNum stripeLength = (segmentSize + diskManager->getNumberOfPartitions() - 1) / diskManager->getNumberOfPartitions();
+
+	PageNum pageOffsetCounter = 0;
+	bool written = true;															// every page was queued for writing
+	PMT2Descriptor* firstDescriptor = nullptr;
+	VirtualAddress address = startAddress;
+																					// for each PMT2 the segment spans do
+	for (PageNum remaining = segmentSize; remaining > 0; ) {
+
+		unsigned short pmt1Entry = extractPage1Part(address);
+		unsigned short first = extractPage2Part(address);
+		unsigned short count = (unsigned short)(remaining < (PageNum)(PMT2Size - first) ? remaining : PMT2Size - first);
+		address += count * PAGE_SIZE;
+		remaining -= count;
+
+		PMT2* pmt2 = getWritablePMT2(process, pmt1Entry);							// allocate the PMT2 if needed
+		getSlotInfo(pmt2).descriptorsInUse += count;								// new descriptors are being added to this PMT2 -- increase the counter
+		initialiseDescriptors(pmt2, first, count, flags, false);					// in use, with the access rights set and no cluster on the disk yet
+
+		if (!firstDescriptor) firstDescriptor = &(*pmt2)[first];
+		if (!load) continue;
+
+		for (unsigned short i = first; i < first + count; i++, pageOffsetCounter++) {	// if loadSegment() is being called, load content
+			PMT2Descriptor* pageDescriptor = &(*pmt2)[i];
+			void* pageContent = (void*)((char*)content + pageOffsetCounter * PAGE_SIZE);
+			if (pageOffsetCounter % stripeLength == 0)								// start of a stripe -- reserve its extent (on the next partition)
+				extentStart = diskManager->allocateExtent(std::min(stripeLength, segmentSize - pageOffsetCounter));
+			if (extentStart != DiskManager::noCluster) {							// write into the reserved extent
+				pageDescriptor->setDisk(extentStart + pageOffsetCounter % stripeLength);
+				written &= diskManager->writeToClusterAsync(pageContent, pageDescriptor->getDisk());
+			}
+			else {																	// fragmented partition -- place each page right after the previous one if possible
+				pageDescriptor->setDisk(diskManager->writeAsync(pageContent, previousCluster == DiskManager::noCluster ? previousCluster : previousCluster + 1));
+				previousCluster = pageDescriptor->getDisk();						// the disk manager's write() returns the cluster number
+				if (previousCluster == DiskManager::noCluster) { written = false; continue; }	// (the page gets no cluster)
 			}
+			pageDescriptor->setHasCluster();										// the page's location on the partition is known
 		}
 	}
 
-	PageNum pageOffsetCounter = 0;													// create descriptor for each page, allocate pmt2 if needed
-	PMT2Descriptor* firstDescriptor = nullptr, *temp = nullptr;
-
-	for (auto entry = entries.begin(); entry != entries.end(); entry++) {			// create all documented descriptors
-
-		PMT2* pmt2 = (*(process->PMT1))[entry->pmt1Entry];
+	if (load && (!diskManager->completeAll() || !written)) {						// the pages were written by the partitions' I/O workers in parallel
+		KernelProcess::SegmentInfo segment(startAddress, flags, segmentSize);		// a page didn't reach the disk -- undo the whole segment
+		process->releaseMemoryAndDisk(&segment);
+		return nullptr;
+	}
 
-		unsigned pageKey = simpleHash(process->id, entry->pmt1Entry);				// key used to access the PMT2 descriptor counter hash table
+	return firstDescriptor;															// operation was successful -- return address of the first descriptor
+}
 
-		if (!pmt2) {																// if the PMT2 table doesn't exist, create it
-			pmt2 = (*(process->PMT1))[entry->pmt1Entry] = (PMT2*)getFreePMTSlot();
-			initialisePMT2(pmt2);
-			if (!pmt2) { mutex.unlock(); return nullptr; }							// this exception should never happen (number of free PMT slots was checked in previous loop)
+KernelSystem::PMT2Descriptor* KernelSystem::connectToSharedSegment(KernelProcess* process, VirtualAddress startAddress,
+	PageNum segmentSize, const char* name, AccessType flags, SharedSegmentHandle& handle) {
 
-			PMT2DescriptorCounter newPMT2Counter(pmt2);								// add new PMT2 to the system's PMT2 descriptor counter
-			activePMT2Counter.insert(std::pair<unsigned, PMT2DescriptorCounter>(pageKey, newPMT2Counter));
+	if (segmentSize == 0) return nullptr;
 
-		}
+	SharedSegment* sharedSegment = nullptr;												// check if a shared segment with that name already exists
 
-		activePMT2Counter[pageKey].counter++;										// a new descriptor is being added to this PMT2 -- increase the counter
+	auto namedSegment = sharedSegmentNames.find(std::string(name));
+	if (namedSegment != sharedSegmentNames.end()) {										// shared segment already exists -- only connect (if there's space)
+		sharedSegment = &sharedSegmentTable[namedSegment->second];
 
-		PMT2Descriptor* pageDescriptor = &(*pmt2)[entry->pmt2Entry];				// access the targetted descriptor
-		if (!firstDescriptor) {														// chain it
-			firstDescriptor = pageDescriptor;
-			temp = firstDescriptor;
-		}
-		else {
-			temp->next = pageDescriptor;
-			temp = temp->next;
-		}
+		if (segmentSize > sharedSegment->length)										// a process may connect to a segment with an equal or lower segSize
+			return nullptr;
 
-		pageDescriptor->setInUse();													// set that the descriptor is now in use
-		switch (flags) {															// set access rights
+		switch (sharedSegment->accessType) {											// access rights to the shared segment have to match for all processes
 		case READ:
-			pageDescriptor->setRd();
+			if (!(flags == READ || flags == READ_WRITE)) return nullptr;
 			break;
 		case WRITE:
-			pageDescriptor->setWr();
+			if (!(flags == WRITE || flags == READ_WRITE)) return nullptr;
 			break;
 		case READ_WRITE:
-			pageDescriptor->setRdWr();
+			if (flags == EXECUTE) return nullptr;
 			break;
 		case EXECUTE:
-			pageDescriptor->setEx();
-			break;
+			if (flags != EXECUTE) return nullptr;
 		}
-
-		if (load) {																	// if loadSegment() is being called, load content
-			void* pageContent = (void*)((char*)content + pageOffsetCounter++ * PAGE_SIZE);
-			pageDescriptor->setDisk(diskManager->write(pageContent));				// the disk manager's write() returns the cluster number
-			pageDescriptor->setHasCluster();										// the page's location on the partition is known
+	}
+																						// if the process attaches on a PMT2 boundary, the shared segment's PMT2s that
+																						// the attach covers entirely are mapped into its PMT1 as they are -- pages
+	unsigned short firstPMT1Entry = extractPage1Part(startAddress);						// [0, directPages) need no PMT2s or descriptors of the process's own
+	PageNum directPages = extractPage2Part(startAddress) == 0 ? segmentSize / PMT2Size * PMT2Size : 0;
+	for (PageNum i = 0; i < directPages; i += PMT2Size)
+		if ((*(process->PMT1))[firstPMT1Entry + i / PMT2Size]) { directPages = 0; break; }	// the process already has a table there
+
+	PageNum requiredPMTs = countMissingPMT2s(process, startAddress + directPages * PAGE_SIZE, segmentSize - directPages);
+	if (!sharedSegment)																	// a new shared segment needs 1xPMT1 + a fixed amount of PMT2s
+		requiredPMTs += 1 + (segmentSize + PMT2Size - 1) / PMT2Size;
+	if (!hasAvailablePMTSlots(requiredPMTs))
+		return nullptr;																	// surely insufficient number of slots in PMT memory
+
+	if (sharedSegment) handle = namedSegment->second;
+	else {																				// shared segment doesn't exist -- create it, then connect
+		if (freeSharedSegmentHandles.empty()) {											// take a handle for the new shared segment
+			handle = (SharedSegmentHandle)sharedSegmentTable.size();
+			sharedSegmentTable.emplace_back();
 		}
 		else {
-			pageDescriptor->resetHasCluster();										// the page does not have a reserved cluster on the disk yet
+			handle = freeSharedSegmentHandles.back();
+			freeSharedSegmentHandles.pop_back();
 		}
-	}
+		sharedSegmentNames.emplace(std::string(name), handle);
 
-	mutex.unlock();
-	return firstDescriptor;															// operation was successful -- return address of the first descriptor
-}
+		sharedSegment = &sharedSegmentTable[handle];
+		sharedSegment->length = segmentSize;											// initialise the new shared segment
+		sharedSegment->pmt2Number = (unsigned short)((segmentSize + PMT2Size - 1) / PMT2Size);
+		sharedSegment->accessType = flags;
+		sharedSegment->pmt1 = (PMT1*)getFreePMTSlot();
 
-KernelSystem::PMT2Descriptor* KernelSystem::connectToSharedSegment(KernelProcess* process, VirtualAddress startAddress,
-	PageNum segmentSize, const char* name, AccessType flags) {
+		for (unsigned short i = 0; i < PMT1Size; i++) {									// initialise all of its pointers to nullptr
+			(*(sharedSegment->pmt1))[i] = nullptr;
+		}
 
-	mutex.lock();
+		for (unsigned short i = 0; i < sharedSegment->pmt2Number; i++) {				// allocate PMT2s for shared segment and initialise descriptors
+			PMT2* pmt2 = (*(sharedSegment->pmt1))[i] = (PMT2*)getFreePMTSlot();
+			initialisePMT2(pmt2);
+			getSlotInfo(pmt2).ofSharedSegment = true;
+
+			PageNum remaining = segmentSize - (PageNum)i * PMT2Size;
+			initialiseDescriptors(pmt2, 0, (unsigned short)(remaining < PMT2Size ? remaining : PMT2Size), flags, false);
+		}
+	}
 
-	SharedSegment* sharedSegment;														// check if a shared segment with that name already exists
+	PMT2Descriptor* firstDescriptor = mapSharedSegmentPMT2s(process, firstPMT1Entry, sharedSegment, directPages);
 
-	struct EntryCreationHelper {														// helper struct for transcation reasons
-		unsigned short pmt1Entry;														// entry in pmt1
-		unsigned short pmt2Entry;														// entry in pmt2
-	};
+	PageNum pageOffsetCounter = directPages;
+	VirtualAddress address = startAddress + directPages * PAGE_SIZE;
+																						// link the rest of the pages, one PMT2 of the process at a time
+	for (PageNum remaining = segmentSize - directPages; remaining > 0; ) {
 
-	std::vector<unsigned short> missingPMT2s;											// remember indices of PMT2 tables that need to be allocated
-	std::vector<EntryCreationHelper> entries;											// contains info of all pages that will be loaded
+		unsigned short pmt1Entry = extractPage1Part(address);
+		unsigned short first = extractPage2Part(address);
+		unsigned short count = (unsigned short)(remaining < (PageNum)(PMT2Size - first) ? remaining : PMT2Size - first);
+		address += count * PAGE_SIZE;
+		remaining -= count;
 
-	try {
-		sharedSegment = &(sharedSegments.at(std::string(name)));						// check for the key but don't insert if nonexistant 
+		PMT2* pmt2 = getWritablePMT2(process, pmt1Entry);								// allocate the PMT2 if needed
+		getSlotInfo(pmt2).descriptorsInUse += count;									// new descriptors are being added to this PMT2 -- increase the counter
+		initialiseDescriptors(pmt2, first, count, flags, true);						// these descriptors represent shared pages
+
+		if (!firstDescriptor) firstDescriptor = &(*pmt2)[first];
+
+		for (unsigned short i = first; i < first + count; i++, pageOffsetCounter++) {	// set each _block_ pointer to the adequate shared segment descriptor
+			PMT2* sharedPMT2 = (*(sharedSegment->pmt1))[pageOffsetCounter / PMT2Size];
+			(*pmt2)[i].setBlock(&(*sharedPMT2)[pageOffsetCounter % PMT2Size]);
+		}
 	}
-	catch (std::out_of_range sharedSegmentDoesntExist) {
-		// shared segment doesn't exist -- create it, then connect
-		// (if there's space for all the needed page tables)
 
-		// for the shared segment: 1xPMT1 + needed, fixed amount of PMT2s
-		unsigned short sharedSegmentRequiredPMTs = 1 + (unsigned short)ceil((double)segmentSize / PMT2Size);
+	return firstDescriptor;																// the caller adds the process to the sharers
+}
 
+KernelSystem::PMT2Descriptor* KernelSystem::mapSharedSegmentPMT2s(KernelProcess* process, unsigned short firstPMT1Entry,
+	SharedSegment* sharedSegment, PageNum pages) {
 
-		for (PageNum i = 0; i < segmentSize; i++) {										// document PMT2 descriptors
-			VirtualAddress blockVirtualAddress = startAddress + i * PAGE_SIZE;
-			EntryCreationHelper entry;													// extract relevant parts of the address
+	if (pages == 0) return nullptr;
 
-			entry.pmt1Entry = KernelSystem::extractPage1Part(blockVirtualAddress);
-			entry.pmt2Entry = KernelSystem::extractPage2Part(blockVirtualAddress);
+	for (PageNum i = 0; i < pages; i += PMT2Size)									// the process's PMT1 entries point at the shared segment's tables
+		(*(process->PMT1))[firstPMT1Entry + i / PMT2Size] = (*(sharedSegment->pmt1))[i / PMT2Size];
 
-			entries.push_back(entry);
+	return &(*(*(sharedSegment->pmt1))[0])[0];
+}
 
-			PMT2* pmt2 = (*(process->PMT1))[entry.pmt1Entry];			     			// access the PMT2 pointer
-			if (!pmt2 && !std::binary_search(missingPMT2s.begin(), missingPMT2s.end(), entry.pmt1Entry)) {
-				missingPMT2s.push_back(entry.pmt1Entry);								// if that pmt2 table doesn't exist yet, add it to the miss list
-				if (missingPMT2s.size() + sharedSegmentRequiredPMTs > numberOfFreePMTSlots) {		// also count the required PMT for the shared segment		
-					mutex.unlock();
-					return nullptr;														// surely insufficient number of slots in PMT memory
-				}
-			}
-		}
+unsigned KernelSystem::addSharer(SharedSegmentHandle handle, KernelProcess* process, VirtualAddress startAddress) {
 
-		SharedSegment newSharedSegment;
-		newSharedSegment.length = segmentSize;											// initialise the new shared segment
-		newSharedSegment.pmt2Number = (unsigned short)ceil((double)segmentSize / PMT2Size);
-		newSharedSegment.accessType = flags;
-		newSharedSegment.numberOfProcessesSharing = 0;
-		newSharedSegment.name = std::string(name);
-		newSharedSegment.pmt1 = (PMT1*)getFreePMTSlot();
+	SharedSegment& sharedSegment = sharedSegmentTable[handle];
 
-		for (unsigned short i = 0; i < PMT1Size; i++) {									// initialise all of its pointers to nullptr
-			(*(newSharedSegment.pmt1))[i] = nullptr;
-		}
+	ReverseSegmentInfo revSegInfo;													// remember the process that has begun sharing
+	revSegInfo.startAddress = startAddress;
+	revSegInfo.process = process;
+	sharedSegment.processesSharing.push_back(revSegInfo);
+
+	return (unsigned)sharedSegment.processesSharing.size() - 1;
+}
+
+void KernelSystem::removeSharer(SharedSegmentHandle handle, unsigned sharerIndex) {
+
+	std::vector<ReverseSegmentInfo>& processesSharing = sharedSegmentTable[handle].processesSharing;
+
+	if (sharerIndex + 1 != processesSharing.size()) {								// move the last sharer into the freed place
+		ReverseSegmentInfo& movedSharer = processesSharing[sharerIndex];
+		movedSharer = processesSharing.back();
+		movedSharer.process->segments.find(movedSharer.startAddress)->second.sharerIndex = sharerIndex;
+	}
+	processesSharing.pop_back();
+}
 
-		// add the shared segment to the system's shared segment map
-		sharedSegments.insert(std::pair<std::string, SharedSegment>(newSharedSegment.name, newSharedSegment));
+PhysicalAddress KernelSystem::getSwappedBlock() {									// this function always returns a block from the list, nullptr if no space on disk
 
-		sharedSegment = &(sharedSegments.at(std::string(name)));						// check for the key but don't insert if nonexistant 
+	bool anyGeneration = false;														// set if the oldest generation only has pages that need a new cluster and the disk is full
+	unsigned short emptyScans = 0;
 
-		PMT2Descriptor* sharedFirstDescriptor = nullptr, *sharedTemp = nullptr;
-		for (unsigned short i = 0; i < sharedSegment->length; i++) {						// allocate PMT2s for shared segment and initialise descriptors
-			unsigned short sharedPMT1Entry = i / PMT2Size;
-			unsigned short sharedPMT2Entry = i % PMT2Size;
+	for (;;) {
+		unsigned oldest = oldestGeneration;
+		if (!anyGeneration && !generationSizes[oldest % numberOfGenerations]) {
+			retireGeneration(oldest);												// don't scan in vain
+			oldest = oldestGeneration;
+		}
 
-			PMT2* pmt2 = (*(sharedSegment->pmt1))[sharedPMT1Entry];
+		bool framesBusy = false, pagesKept = false, diskFull = false;
+		PageNum start = evictionCursor;
 
-			if (!pmt2) {
-				pmt2 = (*(sharedSegment->pmt1))[sharedPMT1Entry] = (PMT2*)getFreePMTSlot();
-				initialisePMT2(pmt2);
+		for (PageNum n = 0; n < processVMSpaceSize; n++) {							// find a victim in the oldest generation, starting where the last search stopped
+			PageNum i = (start + n) % processVMSpaceSize;
+			ReferenceRegister& blockReg = referenceRegisters[i];
+			if (!blockReg.mutex.try_lock()) { framesBusy = true; continue; }		// the page is being used right now, it's not a good victim anyway
+			if (numberOfPendingPMT2s && !blockReg.mappings.empty() && detachDeletedMappings(blockReg)) {
+				evictionCursor = (i + 1) % processVMSpaceSize;						// only deleted processes mapped the block -- nothing to write
+				return (PhysicalAddress)((char*)processVMSpace + (size_t)i * PAGE_SIZE);
+			}
+			if (blockReg.mappings.empty() || (!anyGeneration && (int)(blockReg.generation - oldest) > 0)) {
+				blockReg.mutex.unlock();											// the block is free (or just being handed out), or its page is younger
+				continue;
 			}
-			PMT2Descriptor* pageDescriptor = &(*pmt2)[sharedPMT2Entry];					// access the targetted descriptor
-			if (!sharedFirstDescriptor) {												// chain it
-				sharedFirstDescriptor = pageDescriptor;
-				sharedTemp = sharedFirstDescriptor;
+
+			if (takeReferencedBits(blockReg)) {										// referenced since it was aged -- it's young again
+				moveToGeneration(blockReg, youngestGeneration);
+				pagesKept = true;
 			}
+			else if (blockReg.tier) {												// refaulted recently -- it gets one more generation
+				blockReg.tier = 0;
+				moveToGeneration(blockReg, oldest + 1);
+				pagesKept = true;
+			}																		// write it out only if there's room on the disk for a new cluster
+			else if (!blockReg.mappings.front()->getHasCluster() && !diskManager->hasEnoughSpace(1) && !reclaimSwapCache(1))
+				diskFull = true;
 			else {
-				sharedTemp->next = pageDescriptor;
-				sharedTemp = sharedTemp->next;
+				evictionCursor = (i + 1) % processVMSpaceSize;
+				PhysicalAddress block = blockReg.mappings.front()->getBlock();
+																					// the pointer field is set in pageFault() after this function returns a block address
+				if (!evictPage(blockReg.mappings.front())) {
+					blockReg.mutex.unlock();
+					return nullptr;													// no room on the disk or error while writing
+				}
+				return block;														// return the address of the block the victim had (its frame stays locked)
 			}
+			blockReg.mutex.unlock();
+		}
 
-			pageDescriptor->setInUse();
-			switch (flags) {															// set access rights
-			case READ:
-				pageDescriptor->setRd();
-				break;
-			case WRITE:
-				pageDescriptor->setWr();
-				break;
-			case READ_WRITE:
-				pageDescriptor->setRdWr();
-				break;
-			case EXECUTE:
-				pageDescriptor->setEx();
-				break;
-			}
-			pageDescriptor->resetHasCluster();											// the page does not have a reserved cluster on the disk yet
+		if (framesBusy) std::this_thread::yield();									// pages are being faulted in or accessed, try again
+		else if (pagesKept) continue;												// the kept pages are victims on the next scan if they aren't used meanwhile
+		else if (diskFull) {
+			if (anyGeneration) return nullptr;										// no page can be written out
+			anyGeneration = true;													// a younger page with a cluster is evicted instead
 		}
+		else if (anyGeneration || ++emptyScans > numberOfGenerations) return nullptr;	// this should never be entered (no pages in memory)
+		else retireGeneration(oldest);
+	}
+}
 
-		PageNum pageOffsetCounter = 0;													// create descriptor for each page, allocate pmt2 if needed
-		PMT2Descriptor* firstDescriptor = nullptr, *temp = nullptr;
+PhysicalAddress KernelSystem::getFreeBlock() {
 
-		for (auto entry = entries.begin(); entry != entries.end(); entry++) {			// create all documented descriptors
+	if (!numberOfFreeBlocks) return nullptr;										// don't search the magazines in vain
 
-			PMT2* pmt2 = (*(process->PMT1))[entry->pmt1Entry];
+	std::uint32_t block = takeFromMagazines(blockMagazines, freeBlocks);
+	if (block == IndexStack::empty) return nullptr;
+	numberOfFreeBlocks--;
 
-			unsigned pageKey = simpleHash(process->id, entry->pmt1Entry);				// key used to access the PMT2 descriptor counter hash table
+	return (PhysicalAddress)((char*)processVMSpace + (size_t)block * PAGE_SIZE);
+}
 
-			if (!pmt2) {																// if the PMT2 table doesn't exist, create it
-				pmt2 = (*(process->PMT1))[entry->pmt1Entry] = (PMT2*)getFreePMTSlot();
-				initialisePMT2(pmt2);
-				if (!pmt2) { mutex.unlock(); return nullptr; }							// this exception should never happen (number of free PMT slots was checked in previous loop)
+void KernelSystem::setFreeBlock(PhysicalAddress newFreeBlock) {
+																					// no page holds the block anymore, the aging must not touch its old descriptor
+	removeFromGenerations(blockRegister(newFreeBlock));
 
-				PMT2DescriptorCounter newPMT2Counter(pmt2);								// add new PMT2 to the system's PMT2 descriptor counter
-				activePMT2Counter.insert(std::pair<unsigned, KernelSystem::PMT2DescriptorCounter>(pageKey, newPMT2Counter));
+	putIntoMagazine(blockMagazines, (std::uint32_t)(((char*)newFreeBlock - (char*)processVMSpace) / PAGE_SIZE), freeBlocks);
+	numberOfFreeBlocks++;
+}
 
-			}
+bool KernelSystem::hasFreeBlocks() {
+	return numberOfFreeBlocks > 0;
+}
 
-			activePMT2Counter[pageKey].counter++;										// a new descriptor is being added to this PMT2 -- increase the counter
+KernelSystem::ReferenceRegister* KernelSystem::lockResidentPage(PMT2Descriptor* descriptor) {
 
-			PMT2Descriptor* pageDescriptor = &(*pmt2)[entry->pmt2Entry];				// access the targetted descriptor
-			if (!firstDescriptor) {														// chain it
-				firstDescriptor = pageDescriptor;
-				temp = firstDescriptor;
-			}
-			else {
-				temp->next = pageDescriptor;
-				temp = temp->next;
-			}
+	PhysicalAddress block = descriptor->getBlock();									// only a frame is locked -- the page may never have been loaded
+	if ((char*)block < (char*)processVMSpace || (char*)block >= (char*)processVMSpace + (size_t)processVMSpaceSize * PAGE_SIZE)
+		return nullptr;
 
-			pageDescriptor->setShared();												// this descriptor represents a shared page
-			PhysicalAddress sharedPageDescriptorAddress;								// find the address for the adequate sharedsegment descriptor
-
-			unsigned short sharedPMT1Entry = (unsigned short)pageOffsetCounter / PMT2Size;
-			unsigned short sharedPMT2Entry = (unsigned short)pageOffsetCounter % PMT2Size;
-
-			PMT2* sharedPMT2 = (*(sharedSegment->pmt1))[sharedPMT1Entry];
-			sharedPageDescriptorAddress = (PhysicalAddress)(&((*sharedPMT2)[sharedPMT2Entry]));
-
-			pageDescriptor->setBlock(sharedPageDescriptorAddress);						// set the _block_ pointer to it
-
-			pageDescriptor->setInUse();													// set that the descriptor is now in use
-			switch (flags) {															// set access rights
-			case READ:
-				pageDescriptor->setRd();
-				break;
-			case WRITE:
-				pageDescriptor->setWr();
-				break;
-			case READ_WRITE:
-				pageDescriptor->setRdWr();
-				break;
-			case EXECUTE:
-				pageDescriptor->setEx();
-				break;
-			}
+	ReferenceRegister& blockReg = blockRegister(block);
+	blockReg.mutex.lock();
+	if (descriptor->getV()) return &blockReg;
 
-			pageOffsetCounter++;
-			pageDescriptor->resetHasCluster();											// the page does not have a reserved cluster on the disk yet
+	blockReg.mutex.unlock();														// the page was swapped out while the frame was being waited for
+	return nullptr;
+}
 
-		}
+ProcessId KernelSystem::takeProcessID() {
 
-		ReverseSegmentInfo revSegInfo;													// remember the process that has started sharing
-		revSegInfo.firstDescriptor = firstDescriptor;
-		revSegInfo.process = process;
-		sharedSegment->numberOfProcessesSharing++;
-		sharedSegment->processesSharing.push_back(revSegInfo);
+	std::uint32_t slot = freeProcessSlots->pop();
+	return slot == IndexStack::empty ? noProcessID : processTable[slot].pid.load();
+}
 
-		mutex.unlock();
-		return firstDescriptor;
+void KernelSystem::registerProcess(Process* process) {
+
+	processTable[process->getProcessId() & processSlotMask].process.store(process, std::memory_order_release);
+}
+
+void KernelSystem::releaseProcessID(ProcessId pid) {
+
+	ProcessSlot& slot = processTable[pid & processSlotMask];
+	slot.process = nullptr;
+	slot.pid = pid + ((ProcessId)1 << processSlotBits);						// the next process in the slot gets a new ID, the slot bits stay the same
+	freeProcessSlots->push(pid & processSlotMask);
+}
+
+void KernelSystem::addToYoungestGeneration(ReferenceRegister& blockReg, PMT2Descriptor* descriptor, unsigned char tier) {
+
+	blockReg.mappings.assign(1, descriptor);
+	blockReg.tier = tier;
+	blockReg.generation = youngestGeneration;
+	generationSizes[blockReg.generation % numberOfGenerations]++;
+}
+
+void KernelSystem::retireGeneration(unsigned oldest) {
+																					// at least two generations are kept, so a page that was just loaded is never
+	unsigned youngest = youngestGeneration;											// in the oldest one -- a new youngest generation is opened first if needed
+	if (oldest + 1 == youngest) youngestGeneration.compare_exchange_strong(youngest, youngest + 1);
+	oldestGeneration.compare_exchange_strong(oldest, oldest + 1);					// fails if another thread has retired the generation already
+}
+
+void KernelSystem::moveToGeneration(ReferenceRegister& blockReg, unsigned generation) {
+
+	generationSizes[blockReg.generation % numberOfGenerations]--;
+	blockReg.generation = generation;
+	generationSizes[generation % numberOfGenerations]++;
+}
+
+void KernelSystem::removeFromGenerations(ReferenceRegister& blockReg) {
+
+	if (!blockReg.mappings.empty())												// (the frame may have been emptied already, eg. by evictPage())
+		generationSizes[blockReg.generation % numberOfGenerations]--;
+	blockReg.mappings.clear();														// (keeps its capacity for the next page)
+	blockReg.tier = 0;
+}
+
+bool KernelSystem::takeReferencedBits(ReferenceRegister& blockReg) {
+
+	bool referenced = false;
+	for (PMT2Descriptor* mapping : blockReg.mappings) {							// the block was referenced if any of its descriptors was
+		referenced |= mapping->getReferenced();
+		mapping->resetReferenced();
 	}
+	return referenced;
+}
 
-																						// shared segment already exists -- only connect (if there's space)
-	if (segmentSize > sharedSegment->length) {
-		mutex.unlock();																	// a process may connect to a segment with an equal or lower segSize
-		return nullptr;
+unsigned char KernelSystem::recordRefault(PMT2Descriptor* descriptor) {
+
+	if (!descriptor->getShadow()) return 0;											// loaded for the first time
+	descriptor->resetShadow();
+																					// evictions since the page's own, modulo 2^16
+	unsigned short distance = (unsigned short)((unsigned short)evictions - descriptor->evictionStamp);
+	refaults++;
+	refaultDistanceSum += distance;
+																					// it would have stayed in memory with twice as many blocks
+	if (distance >= (processVMSpaceSize < 0xFFFF ? processVMSpaceSize : 0xFFFF)) return 0;
+	shortRefaults++;
+	return 1;
+}
+
+PhysicalAddress KernelSystem::getFreePMTSlot() {
+
+	if (!numberOfFreePMTSlots) return nullptr;
+
+	std::uint32_t freeSlot = takeFromMagazines(pmtSlotMagazines, freePMTSlots);
+	if (freeSlot == IndexStack::empty) freeSlot = cleanPMT1Slots->pop();			// the last free slots may be waiting for a PMT1
+	if (freeSlot == IndexStack::empty) return nullptr;
+	numberOfFreePMTSlots--;															// decrease the number of free slots
+
+	return (PhysicalAddress)((char*)pmtSlotsStart + (size_t)freeSlot * pmtSlotSize);
+}
+
+void KernelSystem::freePMTSlot(PhysicalAddress slotAddress) {
+
+	putIntoMagazine(pmtSlotMagazines, (std::uint32_t)(((char*)slotAddress - (char*)pmtSlotsStart) / pmtSlotSize), freePMTSlots);
+	numberOfFreePMTSlots++;															// increase number of free slots
+}
+
+KernelSystem::PMT1* KernelSystem::getFreePMT1() {
+
+	std::uint32_t cleanSlot = numberOfFreePMTSlots ? cleanPMT1Slots->pop() : IndexStack::empty;
+	if (cleanSlot != IndexStack::empty) {											// a deleted process's PMT1, still all nullptr
+		numberOfFreePMTSlots--;
+		return (PMT1*)((char*)pmtSlotsStart + (size_t)cleanSlot * pmtSlotSize);
 	}
 
-	switch (sharedSegment->accessType) {													// access rights to the shared segment have to match for all processes
-	case READ:
-		if (!(flags == READ || flags == READ_WRITE)) { mutex.unlock();	return nullptr; }
-		break;
-	case WRITE:
-		if (!(flags == WRITE || flags == READ_WRITE)) { mutex.unlock(); return nullptr; }
-		break;
-	case READ_WRITE:
-		if (flags == EXECUTE) { mutex.unlock(); return nullptr; }
-		break;
-	case EXECUTE:
-		if (flags != EXECUTE) { mutex.unlock(); return nullptr; }
+	PMT1* pmt1 = (PMT1*)getFreePMTSlot();
+	if (pmt1)
+		for (unsigned short i = 0; i < PMT1Size; i++)								// initialise all of its pointers to nullptr
+			(*pmt1)[i] = nullptr;
+	return pmt1;
+}
+
+void KernelSystem::freePMT1(PMT1* pmt1) {
+
+	cleanPMT1Slots->push((std::uint32_t)(((char*)pmt1 - (char*)pmtSlotsStart) / pmtSlotSize));
+	numberOfFreePMTSlots++;
+}
+
+unsigned short KernelSystem::magazineIndex() {
+	static std::atomic<unsigned short> nextIndex{ 0 };
+	static thread_local unsigned short index = nextIndex++ % numberOfMagazines;	// handed out round robin on the thread's first allocation
+	return index;
+}
+
+std::uint32_t KernelSystem::takeFromMagazines(Magazine* magazines, IndexStack* stack) {
+
+	Magazine& local = magazines[magazineIndex()];
+	local.mutex.lock();
+
+	if (!local.count) {																// refill the magazine with a batch from the stack
+		for (std::uint32_t entry; local.count < magazineBatch && (entry = stack->pop()) != IndexStack::empty; )
+			local.entries[local.count++] = entry;
+	}
+
+	std::uint32_t entry = local.count ? local.entries[--local.count] : IndexStack::empty;
+	local.mutex.unlock();
+																					// the remaining free entries are cached by other threads
+	for (unsigned short i = 0; entry == IndexStack::empty && i < numberOfMagazines; i++) {
+		magazines[i].mutex.lock();
+		if (magazines[i].count) entry = magazines[i].entries[--magazines[i].count];
+		magazines[i].mutex.unlock();
 	}
 
-	for (PageNum i = 0; i < segmentSize; i++) {											// document PMT2 descriptors
-		VirtualAddress blockVirtualAddress = startAddress + i * PAGE_SIZE;
-		EntryCreationHelper entry;														// extract relevant parts of the address
+	return entry;
+}
 
-		entry.pmt1Entry = KernelSystem::extractPage1Part(blockVirtualAddress);
-		entry.pmt2Entry = KernelSystem::extractPage2Part(blockVirtualAddress);
+void KernelSystem::putIntoMagazine(Magazine* magazines, std::uint32_t entry, IndexStack* stack) {
 
-		entries.push_back(entry);
+	Magazine& local = magazines[magazineIndex()];
+	local.mutex.lock();
 
-		PMT2* pmt2 = (*(process->PMT1))[entry.pmt1Entry];			     				// access the PMT2 pointer
-		if (!pmt2 && !std::binary_search(missingPMT2s.begin(), missingPMT2s.end(), entry.pmt1Entry)) {
-			missingPMT2s.push_back(entry.pmt1Entry);									// if that pmt2 table doesn't exist yet, add it to the miss list
-			if (missingPMT2s.size() > numberOfFreePMTSlots) {
-				mutex.unlock();
-				return nullptr;															// surely insufficient number of slots in PMT memory
-			}
-		}
+	if (local.count == magazineSize)												// drain a batch onto the stack when the magazine is full
+		while (local.count > magazineSize - magazineBatch)
+			stack->push(local.entries[--local.count]);
+
+	local.entries[local.count++] = entry;
+	local.mutex.unlock();
+}
+
+PageNum KernelSystem::countMissingPMT2s(KernelProcess* process, VirtualAddress startAddress, PageNum pages) {
+
+	if (pages == 0) return 0;
+
+	PageNum missingPMT2s = 0;
+	unsigned short lastPMT1Entry = extractPage1Part(startAddress + (pages - 1) * PAGE_SIZE);
+	for (unsigned short i = extractPage1Part(startAddress); i <= lastPMT1Entry; i++)
+		if (!(*(process->PMT1))[i]) missingPMT2s++;
+
+	return missingPMT2s;
+}
+
+KernelSystem::PMT2* KernelSystem::getWritablePMT2(KernelProcess* process, unsigned short pmt1Entry) {
+
+	PMT2* pmt2 = (*(process->PMT1))[pmt1Entry];
+
+	if (!pmt2) {																	// if the PMT2 table doesn't exist, create it (the caller has checked for a free slot)
+		pmt2 = (*(process->PMT1))[pmt1Entry] = (PMT2*)getFreePMTSlot();
+		initialisePMT2(pmt2);
 	}
+	else if (isPMT2Shared(pmt2))													// the table is still shared with a clone -- copy it before changing it
+		pmt2 = unsharePMT2(process, pmt1Entry);
 
-	PageNum pageOffsetCounter = 0;													// create descriptor for each page, allocate pmt2 if needed
-	PMT2Descriptor* firstDescriptor = nullptr, *temp = nullptr;
+	return pmt2;
+}
 
-	for (auto entry = entries.begin(); entry != entries.end(); entry++) {			// create all documented descriptors
+void KernelSystem::initialiseDescriptors(PMT2* pmt2, unsigned short first, unsigned short count, AccessType flags, bool shared) {
 
-		PMT2* pmt2 = (*(process->PMT1))[entry->pmt1Entry];
+	char basicBits = 0;
+	switch (flags) {																// the access rights, the same for the whole range
+	case READ: basicBits = 0x04; break;
+	case WRITE: basicBits = 0x08; break;
+	case READ_WRITE: basicBits = 0x0C; break;
+	case EXECUTE: basicBits = 0x10; break;
+	}
+	char advancedBits = shared ? 0x11 : 0x01;										// inUse (and isShared)
+
+	for (unsigned short i = first; i < first + count; i++) {						// the descriptors are free, but may still hold the links of
+		PMT2Descriptor& descriptor = (*pmt2)[i];									// a released page -- all of the fields are set
+		descriptor.basicBits.store(basicBits, std::memory_order_relaxed);			// (the exclusive mutex is held, plain stores will do)
+		descriptor.advancedBits.store(advancedBits, std::memory_order_relaxed);
+		descriptor.evictionStamp = 0;
+		descriptor.block = nullptr;
+		descriptor.disk = 0;
+	}
 
-		unsigned pageKey = simpleHash(process->id, entry->pmt1Entry);				// key used to access the PMT2 descriptor counter hash table
+	SummaryMask range = rangeMask(first, count);									// the summary masks are updated once for the whole range
+	pmt2->inUseMask |= range;
+	if (shared) pmt2->sharedMask |= range;
+}
 
-		if (!pmt2) {																// if the PMT2 table doesn't exist, create it
-			pmt2 = (*(process->PMT1))[entry->pmt1Entry] = (PMT2*)getFreePMTSlot();
-			initialisePMT2(pmt2);
-			if (!pmt2) { mutex.unlock(); return nullptr; }							// this exception should never happen (number of free PMT slots was checked in previous loop)
+void KernelSystem::initialisePMT2(PMT2* pmt2) {
+	new (pmt2) PMT2();																// all of the descriptors and the masks start out zeroed
+	getSlotInfo(pmt2) = PMTSlotInfo();												// ... and so do the counter and the holders
+}
 
-			PMT2DescriptorCounter newPMT2Counter(pmt2);								// add new PMT2 to the system's PMT2 descriptor counter
-			activePMT2Counter.insert(std::pair<unsigned, KernelSystem::PMT2DescriptorCounter>(pageKey, newPMT2Counter));
+KernelSystem::PMT2* KernelSystem::unsharePMT2(KernelProcess* process, unsigned short pmt1Entry) {
 
-		}
+	PMT2* sharedPMT2 = (*(process->PMT1))[pmt1Entry];
+	PMT2* privatePMT2 = (PMT2*)getFreePMTSlot();								// there is always a free slot, one was reserved when the table got shared
+	initialisePMT2(privatePMT2);
 
-		activePMT2Counter[pageKey].counter++;										// a new descriptor is being added to this PMT2 -- increase the counter
+	reservedPMTSlots--;
 
-		PMT2Descriptor* pageDescriptor = &(*pmt2)[entry->pmt2Entry];				// access the targetted descriptor
-		if (!firstDescriptor) {														// chain it
-			firstDescriptor = pageDescriptor;
-			temp = firstDescriptor;
-		}
-		else {
-			temp->next = pageDescriptor;
-			temp = temp->next;
-		}
+	for (SummaryMask inUse = sharedPMT2->inUseMask; inUse; inUse &= inUse - 1) {	// both copies map the same blocks and clusters
+		unsigned short i = lowestSetBit(inUse);
+		shareBlock(&(*sharedPMT2)[i], &(*privatePMT2)[i]);
+	}
 
-		pageDescriptor->setShared();												// this descriptor represents a shared page
-		PhysicalAddress sharedPageDescriptorAddress;								// find the address for the adequate sharedsegment descriptor
+	getSlotInfo(sharedPMT2).extraHolders--;										// the other holders keep the original
+	getSlotInfo(privatePMT2).descriptorsInUse = getSlotInfo(sharedPMT2).descriptorsInUse;	// the number of descriptors in use stays the same
 
-		unsigned short sharedPMT1Entry = (unsigned short)pageOffsetCounter / PMT2Size;
-		unsigned short sharedPMT2Entry = (unsigned short)pageOffsetCounter % PMT2Size;
+	(*(process->PMT1))[pmt1Entry] = privatePMT2;
 
-		PMT2* sharedPMT2 = (*(sharedSegment->pmt1))[sharedPMT1Entry];
-		sharedPageDescriptorAddress = (PhysicalAddress)(&((*sharedPMT2)[sharedPMT2Entry]));
+	return privatePMT2;
+}
 
-		pageDescriptor->setBlock(sharedPageDescriptorAddress);						// set the _block_ pointer to it
+void KernelSystem::dropSharedPMT2s(KernelProcess* process) {
 
-		pageDescriptor->setInUse();													// set that the descriptor is now in use
-		switch (flags) {															// set access rights
-		case READ:
-			pageDescriptor->setRd();
-			break;
-		case WRITE:
-			pageDescriptor->setWr();
-			break;
-		case READ_WRITE:
-			pageDescriptor->setRdWr();
-			break;
-		case EXECUTE:
-			pageDescriptor->setEx();
-			break;
+	for (unsigned short i = 0; i < PMT1Size; i++) {
+		PMT2* pmt2 = (*(process->PMT1))[i];
+		if (!pmt2 || !isPMT2Shared(pmt2)) continue;
+
+		getSlotInfo(pmt2).extraHolders--;										// the copy this holder might have needed is no longer reserved
+		reservedPMTSlots--;
+
+		(*(process->PMT1))[i] = nullptr;										// the table stays with the other processes
+	}
+}
+
+void KernelSystem::deferTeardown(KernelProcess* process) {
+
+	for (unsigned short i = 0; i < PMT1Size; i++) {
+		PMT2* pmt2 = (*(process->PMT1))[i];
+		if (!pmt2) continue;
+		if (!isSharedSegmentPMT2(pmt2)) {										// a shared segment table mapped directly stays with the shared segment
+			getSlotInfo(pmt2).ofDeletedProcess = true;							// page faults may take its frames until then
+			pendingPMT2s.push_back(pmt2);
 		}
-		pageOffsetCounter++;
-		pageDescriptor->resetHasCluster();											// the page does not have a reserved cluster on the disk yet
+		(*(process->PMT1))[i] = nullptr;
+	}
+
+	freePMT1(process->PMT1);													// the PMT1 is all nullptr again and can be reused at once
+	process->PMT1 = nullptr;
 
+	{
+		std::lock_guard<std::mutex> guard(reclaimMutex);
+		numberOfPendingPMT2s = pendingPMT2s.size();
 	}
+	reclaimCondition.notify_one();
+}
 
-	ReverseSegmentInfo revSegInfo;													// remember the process that has begun sharing
-	revSegInfo.firstDescriptor = firstDescriptor;
-	revSegInfo.process = process;
-	sharedSegment->numberOfProcessesSharing++;
-	sharedSegment->processesSharing.push_back(revSegInfo);
+void KernelSystem::reclaimPendingPMT2s(PageNum limit) {
 
-	mutex.unlock();
-	return firstDescriptor;
+	for (PageNum i = 0; i < limit && !pendingPMT2s.empty(); i++) {
+		PMT2* pmt2 = pendingPMT2s.back();
+		pendingPMT2s.pop_back();
+																				// shared segment pages belong to the shared segment
+		for (SummaryMask pages = pmt2->inUseMask & ~pmt2->sharedMask; pages; pages &= pages - 1)
+			releasePage(&(*pmt2)[lowestSetBit(pages)]);						// the block and cluster are freed with the last page holding them
+
+		freePMTSlot(pmt2);														// nobody else holds the table (dropSharedPMT2s())
+	}
+
+	numberOfPendingPMT2s = pendingPMT2s.size();
 }
 
-PhysicalAddress KernelSystem::getSwappedBlock() {									// this function always returns a block from the list, nullptr if no space on disk
+bool KernelSystem::hasAvailablePMTSlots(PageNum needed) {
 
-	mutex.lock();
+	while (getNumberOfAvailablePMTSlots() < needed && !pendingPMT2s.empty())	// don't wait for the reclaimer, but only free as many as needed
+		reclaimPendingPMT2s(reclaimBatch);
 
-	PMT2Descriptor* victimHasCluster, *victimHasNoCluster;
-	PageNum victimHasClusterIndex = -1, victimHasNoClusterIndex = -1;				// only compared if there is no room for a new write to the disk
+	return getNumberOfAvailablePMTSlots() >= needed;
+}
 
-	PMT2Descriptor* victim;
-	PageNum victimIndex;
+void KernelSystem::reclaimWorker(KernelSystem* system) {
 
-	for (PageNum i = 0; i < processVMSpaceSize; i++) {								// find victim
-		if (referenceRegisters[i].pageDescriptor->getHasCluster()) {
-			if (victimHasClusterIndex == -1) {
-				victimHasCluster = referenceRegisters[i].pageDescriptor;
-				victimHasClusterIndex = i;
-			}
-			else {
-				if (referenceRegisters[i].value < referenceRegisters[victimHasClusterIndex].value) {
-					victimHasCluster = referenceRegisters[i].pageDescriptor;
-					victimHasClusterIndex = i;
-				}
-			}
+	std::unique_lock<std::mutex> lock(system->reclaimMutex);
+
+	while (true) {
+		system->reclaimCondition.wait(lock, [system] { return system->stopReclaimer || system->numberOfPendingPMT2s > 0; });
+		if (system->stopReclaimer) return;
+
+		lock.unlock();															// a batch per hold, so processes get the mutex in between
+		system->mutex.lock();
+		system->reclaimPendingPMT2s(reclaimBatch);
+		system->mutex.unlock();
+		lock.lock();
+	}
+}
+
+ClusterNo KernelSystem::clusterLocalityHint(PMT2Descriptor* descriptor) {
+	unsigned short index = descriptor->getIndex();								// position of the descriptor inside its PMT2
+
+	for (unsigned short distance = 1; distance < PMT2Size; distance++) {		// look for the closest neighbour that already has a cluster
+		if (index >= distance) {
+			PMT2Descriptor* neighbour = descriptor - distance;
+			if (neighbour->getInUse() && neighbour->getHasCluster() && !neighbour->getShared())
+				return neighbour->getDisk() + distance;
 		}
-		else {
-			if (victimHasNoClusterIndex == -1) {
-				victimHasNoCluster = referenceRegisters[i].pageDescriptor;
-				victimHasNoClusterIndex = i;
-			}
-			else {
-				if (referenceRegisters[i].value < referenceRegisters[victimHasNoClusterIndex].value) {
-					victimHasNoCluster = referenceRegisters[i].pageDescriptor;
-					victimHasNoClusterIndex = i;
-				}
-			}
+		if (index + distance < PMT2Size) {
+			PMT2Descriptor* neighbour = descriptor + distance;
+			if (neighbour->getInUse() && neighbour->getHasCluster() && !neighbour->getShared()
+				&& neighbour->getDisk() >= distance)
+				return neighbour->getDisk() - distance;
 		}
 	}
 
-	if (victimHasClusterIndex == -1 && victimHasNoClusterIndex == -1) {
-		mutex.unlock();																// this should never be entered
-		return nullptr;
+	return DiskManager::noCluster;												// the disk manager continues where it last stopped
+}
+
+void KernelSystem::setDirty(PMT2Descriptor* descriptor) {
+
+	if (descriptor->getD()) return;
+
+	descriptor->setD();
+	if (descriptor->getHasCluster() && diskManager->getNumberOfFreeClusters() < swapSpaceLowWatermark) {
+		diskManager->freeCluster(descriptor->getDisk());						// the cluster's contents are stale now, give it back while it's needed
+		descriptor->resetHasCluster();
 	}
-	else {
-		if (!(victimHasClusterIndex != -1 && victimHasNoClusterIndex != -1)) {		// only pages of one type or the other are in memory
-			if (victimHasClusterIndex != -1) {
-				victim = victimHasCluster;
-				victimIndex = victimHasClusterIndex;
-			}
-			else {
-				victim = victimHasNoCluster;
-				victimIndex = victimHasNoClusterIndex;
-			}
-		}
-		else {																		// find minimal, reverse only if there is no room on disk at the moment
-			if (referenceRegisters[victimHasClusterIndex].value <= referenceRegisters[victimHasNoClusterIndex].value) {
-				victim = victimHasCluster;
-				victimIndex = victimHasClusterIndex;
-			}
-			else {
-				if (diskManager->hasEnoughSpace(1)) {								// if there's room on the disk, allow the minimal to reserve it
-					victim = victimHasNoCluster;
-					victimIndex = victimHasNoClusterIndex;
-				}
-				else {																// otherwise swap minimal with no disk for first minimal with disk
-					victim = victimHasCluster;
-					victimIndex = victimHasClusterIndex;
-				}
+}
 
+bool KernelSystem::reclaimSwapCache(ClusterNo clustersNeeded) {
+
+	ClusterNo target = diskManager->getNumberOfFreeClusters() + (clustersNeeded > swapCacheReclaimBatch ? clustersNeeded : swapCacheReclaimBatch);
+	for (PageNum i = 0; i < processVMSpaceSize && diskManager->getNumberOfFreeClusters() < target; i++) {
+		if (!referenceRegisters[i].mutex.try_lock()) continue;					// frames in use are skipped
+		std::vector<PMT2Descriptor*>& mappings = referenceRegisters[i].mappings;
+		PMT2Descriptor* descriptor = mappings.empty() ? nullptr : mappings.front();
+		if (descriptor && descriptor->getV() && descriptor->getD() && descriptor->getHasCluster()) {
+			for (PMT2Descriptor* mapping : mappings) {							// every descriptor of the block holds a reference
+				diskManager->freeCluster(mapping->getDisk());					// the page will get a new cluster when it's evicted
+				mapping->resetHasCluster();
 			}
 		}
+		referenceRegisters[i].mutex.unlock();
 	}
 
-	referenceRegisters[victimIndex].value = 0;										// reset history bits of block to zero
-																					// the pointer field is set in pageFault() after this function returns a block address
+	return diskManager->hasEnoughSpace(clustersNeeded);
+}
+
+void KernelSystem::shareBlock(PMT2Descriptor* original, PMT2Descriptor* copy) {
+																				// a resident page can't be swapped out while it's being shared
+	ReferenceRegister* frame = original->getShared() ? nullptr : lockResidentPage(original);
+
+	copy->setBits(original->basicBits, original->advancedBits);					// the bits stay the same
+	copy->block = original->block;
+	copy->disk = original->disk;
+	copy->evictionStamp = original->evictionStamp;								// a swapped out page's shadow entry is inherited too
+
+	if (original->getShared()) return;											// a shared segment page is only linked to the shared descriptor
+
+	original->setCopyOnWrite();													// the first write from either side makes a private copy
+	copy->setCopyOnWrite();
+
+	if (frame)
+		frame->mappings.push_back(copy);
+	if (original->getHasCluster())
+		diskManager->addClusterReference(original->getDisk());
+
+	if (frame) frame->mutex.unlock();
+}
+
+bool KernelSystem::detachDeletedMappings(ReferenceRegister& blockReg) {
+
+	for (size_t i = blockReg.mappings.size(); i-- > 0; ) {						// (detachFromBlock() fills the hole from the back)
+		PMT2Descriptor* mapping = blockReg.mappings[i];
+		if (!getSlotInfo(mapping->getTable()).ofDeletedProcess) continue;
 
-	if (victim->getShared() || victim->getCloned()) {								// should always enter because cloned = 1
-		victim->resetV();
-		victim->resetReferenced();
-		victim = (PMT2Descriptor*)victim->block;
+		bool last = detachFromBlock(mapping);
+		mapping->resetV();														// the reclaimer only drops its cluster then
+		if (last) return true;
 	}
+	return false;
+}
 
-	if (victim->getD()) {															// write the block to the disk if it's dirty (always true for never-before-written-to-disk createSegment() pages)
-		if (victim->getHasCluster())												// if the page already has a reserved cluster on the disk, write contents there
-			diskManager->writeToCluster(victim->getBlock(), victim->getDisk());
-		else {																		// if not, attempt to find an empty slot
-			victim->setDisk(diskManager->write(victim->getBlock()));
-			if (victim->getDisk() == -1) {
-				mutex.unlock();
-				return nullptr;														// no room on the disk or error while writing
-			}
-			victim->setHasCluster();												// the victim now has a cluster on the disk
-		}
-		victim->resetD();
+bool KernelSystem::detachFromBlock(PMT2Descriptor* descriptor) {
+
+	ReferenceRegister& blockReg = blockRegister(descriptor->getBlock());
+
+	if (blockReg.mappings.size() == 1) {
+		removeFromGenerations(blockReg);
+		return true;															// nobody maps the block anymore
 	}
 
-	victim->resetReferenced();														// if it was referenced, it might not immediately be on the next load
-	victim->resetV();																// the page is no longer in memory, set valid to zero
+	auto mapping = std::find(blockReg.mappings.begin(), blockReg.mappings.end(), descriptor);
+	*mapping = blockReg.mappings.back();
+	blockReg.mappings.pop_back();
 
-	mutex.unlock();
-	return victim->getBlock();														// return the address of the block the victim had
+	PMT2Descriptor* remaining = blockReg.mappings.front();						// a page left on its own can be written without copying
+	if (blockReg.mappings.size() == 1 && !(remaining->getHasCluster() && diskManager->isClusterShared(remaining->getDisk())))
+		remaining->resetCopyOnWrite();
+
+	return false;
 }
 
-PhysicalAddress KernelSystem::getFreeBlock() {
+void KernelSystem::releasePage(PMT2Descriptor* descriptor) {
 
-	mutex.lock();
+	if (descriptor->getV() && detachFromBlock(descriptor))						// if the page is in memory and it was the last one mapping the block, declare the block as free
+		setFreeBlock(descriptor->getBlock());
 
-	if (!freeBlocksHead) { mutex.unlock(); return nullptr; }
+	if (descriptor->getHasCluster())											// if the page is saved on disk, drop its reference to the cluster
+		diskManager->freeCluster(descriptor->getDisk());
+}
 
-	PhysicalAddress block = freeBlocksHead;											// retrieve the free block
-	freeBlocksHead = (PhysicalAddress)(*(unsigned*)(block));						// move the free blocks head onto the next free block in the list
+Status KernelSystem::resolveCopyOnWrite(PMT2Descriptor* descriptor) {
 
-	mutex.unlock();
-	return block;
-}
+	if (blockRegister(descriptor->getBlock()).mappings.size() == 1) {			// nobody else maps the block -- take it over instead of copying it
+		descriptor->resetCopyOnWrite();
+		if (descriptor->getHasCluster() && diskManager->isClusterShared(descriptor->getDisk())) {
+			diskManager->freeCluster(descriptor->getDisk());					// swapped out copies still need the cluster's contents
+			descriptor->resetHasCluster();
+			descriptor->setD();
+		}
+		return OK;
+	}
 
-void KernelSystem::setFreeBlock(PhysicalAddress newFreeBlock) {
+	PhysicalAddress freeBlock = getFreeBlock();									// copy the page into a block of its own
+	if (freeBlock) blockRegister(freeBlock).mutex.lock();						// nobody else waits for a block that was just taken off the list
+	else freeBlock = getSwappedBlock();											// this may swap out the page itself (its frame is locked twice then)
+	if (!freeBlock) return TRAP;
 
-	mutex.lock();
-	unsigned* block = (unsigned*)newFreeBlock;
+	if (descriptor->getV()) {
+		memcpy(freeBlock, descriptor->getBlock(), PAGE_SIZE);
+		detachFromBlock(descriptor);
+	}																			// otherwise the page was just swapped out of _freeBlock_ and its contents are still there
 
-	*block = (unsigned)((char*)freeBlocksHead);										// chain the new block as the new first element of the list
-	freeBlocksHead = block;
-	mutex.unlock();
+	if (descriptor->getHasCluster()) {											// the cluster is only reserved once the copy is swapped out
+		diskManager->freeCluster(descriptor->getDisk());
+		descriptor->resetHasCluster();
+	}
+
+	descriptor->setV();
+	descriptor->setD();
+	descriptor->resetCopyOnWrite();
+	descriptor->resetShadow();													// (set if the copy's block was the page's own)
+	descriptor->setBlock(freeBlock);
+
+	ReferenceRegister& blockReg = blockRegister(freeBlock);
+	addToYoungestGeneration(blockReg, descriptor, 0);
+
+	blockReg.mutex.unlock();
+	return OK;
 }
 
-PhysicalAddress KernelSystem::getFreePMTSlot() {
+bool KernelSystem::evictPage(PMT2Descriptor* descriptor, bool asynchronous) {
 
-	mutex.lock();
+	ReferenceRegister& blockReg = blockRegister(descriptor->getBlock());
+	descriptor = blockReg.mappings.front();										// all descriptors of the block are in the same state
 
-	if (!numberOfFreePMTSlots) { mutex.unlock(); return nullptr; }
+	if (descriptor->getD()) {													// write the block to the disk if it's dirty (always true for never-before-written-to-disk createSegment() pages)
+		if (descriptor->getHasCluster()) {										// if the page already has a reserved cluster on the disk, write contents there
+			bool written = asynchronous ? diskManager->writeToClusterAsync(descriptor->getBlock(), descriptor->getDisk())
+				: diskManager->writeToCluster(descriptor->getBlock(), descriptor->getDisk());
+			if (!written) return false;											// the page stays in memory
+		}
+		else {																	// if not, attempt to find an empty slot
+			if (!diskManager->hasEnoughSpace(1)) reclaimSwapCache(1);			// take a stale cluster from a dirty resident page if the disk is full
+			ClusterNo cluster = asynchronous ? diskManager->writeAsync(descriptor->getBlock(), clusterLocalityHint(descriptor))
+				: diskManager->write(descriptor->getBlock(), clusterLocalityHint(descriptor));
+			if (cluster == DiskManager::noCluster) {
+				return false;													// no room on the disk or error while writing
+			}
 
-	PhysicalAddress freeSlot = freePMTSlotHead;										// assign a free block to the required PMT1/PMT2
-	freePMTSlotHead = (PhysicalAddress)(*((unsigned*)freePMTSlotHead));				// move the pmt list head
+			for (PMT2Descriptor* mapping : blockReg.mappings) {				// the page now has a cluster on the disk
+				mapping->setDisk(cluster);
+				mapping->setHasCluster();
+				if (mapping != descriptor) diskManager->addClusterReference(cluster);	// (one reference per descriptor)
+			}
+		}
+	}
 
-	numberOfFreePMTSlots--;															// decrease the number of free slots
+	unsigned short evictionStamp = (unsigned short)evictions++;					// the shadow entry, a refault measures its distance from it
 
-	mutex.unlock();
+	for (PMT2Descriptor* mapping : blockReg.mappings) {							// every descriptor mapping the block is invalidated at once
+		mapping->resetD();														// the page is no longer in memory, set valid to zero
+		mapping->resetV();
+		mapping->resetReferenced();												// if it was referenced, it might not immediately be on the next load
+		mapping->evictionStamp = evictionStamp;
+		mapping->setShadow();
+	}
 
-	return freeSlot;
+	removeFromGenerations(blockReg);											// the block is handed out or freed by the caller
+
+	return true;
 }
 
-void KernelSystem::freePMTSlot(PhysicalAddress slotAddress) {
+void KernelSystem::restoreEvictedPage(PhysicalAddress block, const std::vector<PMT2Descriptor*>& mappings, bool dirty) {
 
-	mutex.lock();
-	unsigned* slot = (unsigned*)slotAddress;
+	ReferenceRegister& blockReg = blockRegister(block);
+	addToYoungestGeneration(blockReg, mappings.front(), 0);
+	blockReg.mappings = mappings;
 
-	*slot = (unsigned)((char*)freePMTSlotHead);										// chain the new slot as the new first element of the list
-	freePMTSlotHead = slot;
+	for (PMT2Descriptor* mapping : mappings) {									// the block still holds the page, evictPage() only invalidated it
+		mapping->resetShadow();
+		mapping->setV();
+		if (dirty) mapping->setD();												// the copy on the disk can't be trusted
+	}
+}
 
-	numberOfFreePMTSlots++;															// increase number of free slots
-	mutex.unlock();
+void KernelSystem::deduplicatePages() {
+
+	std::unordered_multimap<unsigned long long, PMT2Descriptor*> candidates;	// first page seen with a given content hash
+
+	for (std::uint32_t slot = 0; slot < processTableSize; slot++) {
+		Process* process = processTable[slot].process;
+		if (!process) continue;
+		KernelProcess* kernelProcess = process->pProcess;
+
+		for (auto entry = kernelProcess->segments.begin(); entry != kernelProcess->segments.end(); entry++) {
+			const KernelProcess::SegmentInfo* segment = &entry->second;
+			if (segment->sharedSegment != noSharedSegment) continue;						// shared segments already have a single copy
+			if (segment->accessType != READ && segment->accessType != EXECUTE) continue;
+
+			VirtualAddress address = segment->startAddress;
+			for (PageNum remaining = segment->length; remaining > 0; ) {		// one PMT2 worth of the segment at a time
+				unsigned short first = extractPage2Part(address);
+				unsigned short count = (unsigned short)(remaining < (PageNum)(PMT2Size - first) ? remaining : PMT2Size - first);
+				PMT2* pmt2 = (*(kernelProcess->PMT1))[extractPage1Part(address)];
+				address += count * PAGE_SIZE;
+				remaining -= count;
+
+				if (!pmt2) continue;											// the process is being deleted and has let go of a shared table
+																				// only clean pages in memory are compared
+				for (SummaryMask clean = rangeMask(first, count) & pmt2->validMask & ~pmt2->dirtyMask; clean; clean &= clean - 1) {
+					PMT2Descriptor* descriptor = &(*pmt2)[lowestSetBit(clean)];
+
+					unsigned long long hash = hashBlock(descriptor->getBlock());
+					auto range = candidates.equal_range(hash);
+					auto match = range.first;
+					for (; match != range.second; match++) {						// the hash may collide -- compare the actual contents
+						if (match->second->getBlock() == descriptor->getBlock()) break;	// cloned page already seen through another process
+						if (match->second->getRights() != descriptor->getRights()) continue;	// only pages with the same rights are merged
+						if (!memcmp(match->second->getBlock(), descriptor->getBlock(), PAGE_SIZE)) break;
+					}
+
+					if (match == range.second)										// first page with this content
+						candidates.insert(std::make_pair(hash, descriptor));
+					else if (match->second->getBlock() != descriptor->getBlock())
+						mergePages(descriptor, match->second);
+				}
+			}
+		}
+	}
 }
 
-void KernelSystem::initialisePMT2(PMT2* pmt2) {
-	for (unsigned short i = 0; i < PMT2Size; i++) {
-		(*pmt2)[i].basicBits = (*pmt2)[i].advancedBits = 0;
-		(*pmt2)[i].block = (*pmt2)[i].next = nullptr;
+void KernelSystem::mergePages(PMT2Descriptor* duplicate, PMT2Descriptor* original) {
+
+	PhysicalAddress duplicateBlock = duplicate->getBlock();
+	ReferenceRegister& duplicateReg = blockRegister(duplicateBlock);
+	ReferenceRegister& originalReg = blockRegister(original->getBlock());
+
+	std::vector<PMT2Descriptor*> members(duplicateReg.mappings);				// everything mapping the duplicate block
+
+	if (duplicate->getHasCluster()) {											// the contents are equal, so only one cluster is needed
+		ClusterNo cluster = duplicate->getDisk();
+		if (original->getHasCluster() && diskManager->getClusterReferences(cluster) == members.size())
+			deduplicationStatistics.clustersSaved++;
+		for (size_t i = 0; i < members.size(); i++)
+			diskManager->freeCluster(cluster);
+	}
+
+	original->setCopyOnWrite();													// writes to any of the pages now make a private copy
+	for (PMT2Descriptor* member : members) {
+		member->setBits((char)((original->basicBits & ~0x1C) | member->getRights()), original->advancedBits);	// the member keeps its own rights
+		member->block = original->block;
+		member->disk = original->disk;
+		if (original->getHasCluster()) diskManager->addClusterReference(original->getDisk());
+		originalReg.mappings.push_back(member);
+	}
+
+	setFreeBlock(duplicateBlock);												// the duplicate block is no longer used by anyone
+
+	deduplicationStatistics.pagesMerged += members.size();
+	deduplicationStatistics.framesSaved++;
+}
+
+unsigned long long KernelSystem::hashBlock(PhysicalAddress block) {
+	unsigned long long hash = 14695981039346656037ULL;
+	unsigned char* bytes = (unsigned char*)block;
+	for (unsigned short i = 0; i < PAGE_SIZE; i++) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
 	}
+	return hash;
 }
 
 // 64bit 0000 0000 0000 0000 0000 0000 0000 0000 0000 0000 0000 0000 0000 0000 0000 0000
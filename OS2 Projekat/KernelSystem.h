@@ -2,15 +2,25 @@
 
 #define _kernelsystem_h_
 
+#include <atomic>
+#include <cstdint>
 #include <vector>
 #include <iostream>
 #include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <thread>
 #include <unordered_map>
 
 #include "vm_declarations.h"
 #include "Semaphore.h"
 #include "part.h"
 #include "DiskManager.h"
+#include "IndexStack.h"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
 
 class Partition;
 class Process;
@@ -24,6 +34,9 @@ public:
 	KernelSystem(PhysicalAddress processVMSpace, PageNum processVMSpaceSize,
 		PhysicalAddress pmtSpace, PageNum pmtSpaceSize,
 		Partition* partition);
+	KernelSystem(PhysicalAddress processVMSpace, PageNum processVMSpaceSize,
+		PhysicalAddress pmtSpace, PageNum pmtSpaceSize,
+		Partition** partitions, unsigned short numberOfPartitions, StripingPolicy policy);
 
 	~KernelSystem();
 
@@ -34,6 +47,12 @@ public:
 	Status access(ProcessId pid, VirtualAddress address, AccessType type);
 
 	Process* cloneProcess(ProcessId pid);
+	std::vector<Process*> cloneProcessN(ProcessId pid, unsigned n);
+
+	void setDeduplication(bool enabled);										// turns the periodic merging of identical read-only pages on or off
+	DeduplicationStatistics getDeduplicationStatistics();
+
+	ReplacementStatistics getReplacementStatistics();
 
 private:																		// private attributes
 
@@ -43,44 +62,111 @@ private:																		// private attributes
 	PhysicalAddress pmtSpace;													// page map tables memory
 	PageNum pmtSpaceSize;
 
-	ProcessId processIDGenerator = 0;											// generates the ID for each new process
-	std::unordered_map<ProcessId, Process*> activeProcesses;					// active process hash map
+																				// PROCESS TABLE -- a process ID is (generation << processSlotBits) | slot, the slot of a
+																				// deleted process is reused with the next generation, so its old ID doesn't find the new process
+	static const unsigned short processSlotBits = 16;
+	static const ProcessId processSlotMask = ((ProcessId)1 << processSlotBits) - 1;
+	static const ProcessId noProcessID = (ProcessId)-1;							// (slot 0xFFFF is never used)
+
+	struct ProcessSlot {
+		std::atomic<Process*> process{ nullptr };								// nullptr while the slot is free or its process is being made
+		std::atomic<ProcessId> pid{ 0 };										// ID of the slot's current process, or of the next one
+	};
+	ProcessSlot* processTable;													// written with the mutex held exclusively, read lock-free
+	std::uint32_t processTableSize;												// every process takes a PMT slot for its PMT1, so there can't be more processes than slots
+	IndexStack* freeProcessSlots;
 
 	struct PMT2Descriptor;
 	struct ReferenceRegister {
-		unsigned value = 0;														// value of the reference register (32-bit history)
-		PMT2Descriptor* pageDescriptor = nullptr;								// descriptor for the page that currently holds this register's block
+		unsigned generation = 0;												// generation of the block's page (see GENERATIONS)
+		unsigned char tier = 0;													// 1 if the page was refaulted shortly after its eviction, it survives one eviction scan
+		std::vector<PMT2Descriptor*> mappings;									// reverse map -- every descriptor mapping the block (a page and its cloned or merged
+																				// copies, all in the same state), empty while the block is free; processes attached to
+																				// a shared segment reach its single descriptor, so they're all covered by it
+
+		std::recursive_mutex mutex;												// frame lock, guards the register and the residency of every descriptor mapping the block
 	};
 	ReferenceRegister* referenceRegisters;										// dynamic array of reference registers 
 
-	struct PMT2DescriptorCounter {
-		PhysicalAddress pmt2StartAddress;										// start address of the PMT2
-		unsigned short counter = 0;												// number of descriptors in the PMT2 with the inUse bit equal to 1
-
-																				
-		std::vector<std::pair<unsigned, unsigned>> sourceDescriptorCounters;	// if this is a cloning PMT2 remember number of references to each descriptor
-
-		PMT2DescriptorCounter() {}
-		PMT2DescriptorCounter(PhysicalAddress startAddress) : pmt2StartAddress(startAddress) {}
+	struct PMTSlotInfo {														// bookkeeping of a PMT slot holding a process's PMT2
+		unsigned short descriptorsInUse = 0;									// descriptors with the inUse bit set, the slot is freed when it drops to 0
+		unsigned short extraHolders = 0;										// processes holding the table after a clone besides the first, it's only read while shared
+		bool ofSharedSegment = false;											// the table belongs to a shared segment, processes attached on a PMT2 boundary
+																				// map it directly (it's never copied or freed through them)
+		bool ofDeletedProcess = false;											// the table waits for the reclaimer, its pages are free for the taking
 	};
-
-	std::unordered_map<unsigned, PMT2DescriptorCounter> activePMT2Counter;		// keeps track of the number of descriptors in the allocated PMT2 tables (non-shared)
-
-	std::vector<ProcessId> processesAttemptingCopyOnWrite;						// a small temporary buffer for processes who are attempting copy on write
-
-	PhysicalAddress freePMTSlotHead;											// head for the PMT1 blocks
-	PhysicalAddress freeBlocksHead;												// head for the free physical blocks in memory
-
-	PageNum numberOfFreePMTSlots;												// counts the number of free PMT slots 
+	PMTSlotInfo* pmtSlotInfo;													// one per PMT slot (by slot number)
+
+	IndexStack* freePMTSlots;													// free PMT1/PMT2 slots (by slot number, lock-free)
+	IndexStack* cleanPMT1Slots;													// free slots left by deleted processes' PMT1s, whose entries are all nullptr,
+																				// handed to new processes as they are (counted among the free slots)
+	IndexStack* freeBlocks;														// free physical blocks in memory (by block number, lock-free)
+	PhysicalAddress pmtSlotsStart;												// the first slot (aligned to pmtSlotSize)
+
+	std::atomic<PageNum> numberOfFreeBlocks;									// free blocks, on the stack and in the magazines
+	std::atomic<PageNum> numberOfFreePMTSlots;									// counts the number of free PMT slots (on the stack and in the magazines)
+	std::atomic<PageNum> reservedPMTSlots{ 0 };									// free slots kept for the copies of shared PMT2s (one per extra holder)
+
+																				// MAGAZINES -- every thread keeps a few free blocks and PMT slots of its own, the global
+																				// stacks are only used to refill or drain a magazine (_magazineBatch_ entries at a time)
+	static const unsigned short numberOfMagazines = 16;							// threads beyond this many share magazines
+	static const unsigned short magazineSize = 32;
+	static const unsigned short magazineBatch = 16;
+
+	struct Magazine {
+		std::mutex mutex;														// only contended if the magazine is shared or another thread steals from it
+		std::uint32_t entries[magazineSize];									// block or slot numbers
+		unsigned short count = 0;
+	};
+	Magazine blockMagazines[numberOfMagazines];
+	Magazine pmtSlotMagazines[numberOfMagazines];
 
 	DiskManager* diskManager;													// encapsulates all of the operations with the partition
 
-	std::recursive_mutex mutex;													// a mutex for synchronisation
+	// LOCK ORDER -- a lock is only waited for while holding locks above it, locks below are only tried (try_lock())
+	//
+	//	1. mutex						exclusive: creating and deleting processes, segments and shared segments, cloning,
+	//									deduplication and thrashing; shared: access(), pageFault(), getPhysicalAddress()
+	//									and the aging in periodicJob(), which only move pages in and out of memory
+	//	2. KernelProcess::pageTableMutex	the process's PMT1 entries (which PMT2s the process holds)
+	//	3. PMT2::mutex					descriptors that aren't resident and the holders of the table; a process's PMT2
+	//									is locked before the shared segment PMT2 its descriptor links to (a shared
+	//									segment PMT2 mapped directly is locked as one of the process's own)
+	//	4. ReferenceRegister::mutex		a block's register and the resident descriptors mapping it (valid, dirty,
+	//									referenced, copy on write and cluster bits); a second frame is only waited for
+	//									if it was just taken off the free block list, other frames are tried (victims)
+	//	5. Magazine::mutex (one at a time), the DiskManager's locks, reclaimMutex (never held while waiting for 1.)
+	//
+	// Holding the mutex exclusively excludes everything below it, so structural changes take no other locks but 5.
+
+	std::shared_timed_mutex mutex;												// structure lock
 	Semaphore thrashingSemaphore;												// semaphore that blocks processes that initiated system thrashing
-	unsigned short consecutivePageFaultsCounter = 0;							// counts consecutive page faults and compares this value to _pageFaultLimitNumber_
-
-	struct SharedSegment;
-	std::unordered_map<std::string, SharedSegment> sharedSegments;				// keeps track of all the shared segments
+	std::atomic<unsigned short> consecutivePageFaultsCounter{ 0 };				// counts consecutive page faults and compares this value to _pageFaultLimitNumber_
+
+																				// AGING -- each periodicJob() call ages a slice of the frames, a full pass takes _agingPeriod_
+	std::mutex agingMutex;														// serialises periodicJob() calls (taken before the frames)
+	PageNum agingCursor = 0;													// the next frame to age
+	Time agingPeriod = maximumAgingPeriod;										// shortened while the system is paging hard
+	std::atomic<unsigned> pageFaultsSinceAging{ 0 };							// page faults reported by access() since the last periodicJob() call
+
+																				// GENERATIONS (multi-generational LRU) -- every resident page is in one of the generations
+																				// [oldestGeneration, youngestGeneration]; a page referenced since it was last looked at moves
+																				// to the youngest one, a completed aging pass opens a new youngest generation and victims
+																				// are only taken from the oldest, which is never the youngest (sequence numbers, generation g
+																				// is counted in slot g % 4)
+	static const unsigned short numberOfGenerations = 4;
+	std::atomic<unsigned> oldestGeneration{ 0 }, youngestGeneration{ 1 };
+	std::atomic<PageNum> generationSizes[numberOfGenerations] = {};				// resident pages in each slot
+	std::atomic<PageNum> evictionCursor{ 0 };									// frame the next victim scan starts from
+
+	std::atomic<PageNum> evictions{ 0 };										// evicted pages keep the low 16 bits of this count in their descriptors (shadow entries)
+	std::atomic<PageNum> refaults{ 0 };											// refault statistics (see ReplacementStatistics)
+	std::atomic<PageNum> shortRefaults{ 0 };
+	std::atomic<unsigned long long> refaultDistanceSum{ 0 };
+
+	bool deduplicationEnabled = false;											// if set, periodicJob() merges identical read-only/execute pages
+	unsigned short deduplicationTickCounter = 0;								// counts aging passes since the last deduplication pass
+	DeduplicationStatistics deduplicationStatistics;
 
 																				// CONSTANTS
 
@@ -94,50 +180,72 @@ private:																		// private attributes
 
 	static const unsigned short pageFaultLimitNumber = 50;						// after _pageFaultLmitNumber_ consecutive page faults thrashing is detected
 
+	static const unsigned short deduplicationPeriod = 10;						// a deduplication pass is made every _deduplicationPeriod_ aging passes
+
+	static const PageNum agingSliceSize = 1024;									// frames aged by one periodicJob() call at most
+	static const Time maximumAgingPeriod = 100;									// a pass over all of the frames (ms) when memory isn't under pressure
+	static const Time minimumAgingPeriod = 10;									// ... and when faults keep evicting pages
+
+	static const ClusterNo swapSpaceLowWatermark = 64;							// below this many free clusters a page gives up its cluster as soon as it's dirtied
+	static const ClusterNo swapCacheReclaimBatch = 32;							// clusters reclaimed from dirty resident pages at once when the disk is full
+	static const PageNum reclaimBatch = 16;										// PMT2s of deleted processes freed per exclusive hold of the mutex
+
 																				// MEMORY ORGANISATION
 
+	struct PMT2;																// a table of descriptors (defined below)
+
 	struct PMT2Descriptor {
-		char basicBits = 0;														// _/_/_/execute/write/read/dirty/valid bits
-		char advancedBits = 0;													// _/_/_/isShared/referenced/cloned/hasCluster/inUse bits
+		std::atomic<char> basicBits{ 0 };										// _/_/_/execute/write/read/dirty/valid bits
+		std::atomic<char> advancedBits{ 0 };									// _/_/copyOnWrite/isShared/referenced/shadow/hasCluster/inUse bits
+																				// (atomic -- the rights, inUse and shared bits are read under the page table
+																				// lock while the frame's holder changes the other bits of the same byte)
 
 		// bool hasCluster = 0;													// indicates whether a cluster has been reserved for this page
 		// bool inUse = 0;														// indicates whether the descriptor is in use yet or not
 		// bool isShared = 0;													// if the page is shared, the _block_ field points to the mutual descriptor
 
 		// if isShared == 1														=> only bits ex/wr/rd + inUse are looked at (in the original descriptors)
-		// if cloned == 1														=> only bits ex/wr/rd + inUse are looked at (in the original descriptors)
+		// if copyOnWrite == 1													=> the block and cluster may be mapped by other descriptors as well, a write makes a private copy first
+
+		unsigned short evictionStamp = 0;										// evictions counted when the page was last evicted (valid if shadow = 1)
 
 		PhysicalAddress block = nullptr;										// remember pointer to a block of physical memory
-		PMT2Descriptor* next = nullptr;											// next in segment and next in the global politics swapping technique
-		ClusterNo disk;															// cluster that holds this page or the key for the cloning PMT2 (if cloned = 1)
+		ClusterNo disk;															// cluster that holds this page (valid if hasCluster = 1)
 
 		PMT2Descriptor() {}
+																				// the bits mirrored in the PMT2's summary masks are changed out of line (after struct PMT2)
+		PMT2* getTable();														// the PMT2 the descriptor is in
+		unsigned short getIndex();												// position of the descriptor inside its PMT2
+		void setBits(char newBasicBits, char newAdvancedBits);					// overwrites all of the bits (eg. with another descriptor's)
+		void release();															// clears the bits and the links to a frame, a cluster or a shared descriptor
+
 																				// basic bit operations
-		void setV() { basicBits |= 0x01; } void resetV() { basicBits &= 0xFE; } bool getV() { return (basicBits & 0x01) ? true : false; }
-		void setD() { basicBits |= 0x02; } void resetD() { basicBits &= 0xFD; } bool getD() { return (basicBits & 0x02) ? true : false; }
+		void setV(); void resetV(); bool getV() { return (basicBits & 0x01) ? true : false; }
+		void setD(); void resetD(); bool getD() { return (basicBits & 0x02) ? true : false; }
 		void setRd() { basicBits |= 0x04; } bool getRd() { return (basicBits & 0x04) ? true : false; }
 		void setWr() { basicBits |= 0x08; } bool getWr() { return (basicBits & 0x08) ? true : false; }
 		void setRdWr() { basicBits |= 0x0C; }
 		void setEx() { basicBits |= 0x10; } bool getEx() { return (basicBits & 0x10) ? true : false; }
+		char getRights() { return basicBits & 0x1C; }							// the execute/write/read bits
 
 																				// advanced bit operations
 
-		//void setCopyOnWrite() { advancedBits |= 0x20; } void resetCopyOnWrite() { advancedBits &= 0xDF; }
-		//bool getCopyOnWrite() { return (advancedBits & 0x20) ? true : false; }
+		void setCopyOnWrite(); void resetCopyOnWrite();
+		bool getCopyOnWrite() { return (advancedBits & 0x20) ? true : false; }
 
-		void setShared() { advancedBits |= 0x10; } void resetShared() { advancedBits &= 0xEF; }
+		void setShared(); void resetShared();
 		bool getShared() { return (advancedBits & 0x10) ? true : false; }
 
 		void setReferenced() { advancedBits |= 0x08; } void resetReferenced() { advancedBits &= 0xF7; }
 		bool getReferenced() { return (advancedBits & 0x08) ? true : false; }
 
-		void setCloned() { advancedBits |= 0x04; } void resetCloned() { advancedBits &= 0xFB; }
-		bool getCloned() { return (advancedBits & 0x04) ? true : false; }
+		void setShadow() { advancedBits |= 0x04; } void resetShadow() { advancedBits &= 0xFB; }
+		bool getShadow() { return (advancedBits & 0x04) ? true : false; }
 
 		void setHasCluster() { advancedBits |= 0x02; } void resetHasCluster() { advancedBits &= 0xFD; }
 		bool getHasCluster() { return (advancedBits & 0x02) ? true : false; }
 
-		void setInUse() { advancedBits |= 0x01; } void resetInUse() { advancedBits &= 0xFE; }
+		void setInUse(); void resetInUse();
 		bool getInUse() { return (advancedBits & 0x01) ? true : false; }
 
 		void setBlock(PhysicalAddress newBlock) { block = newBlock; }
@@ -145,32 +253,71 @@ private:																		// private attributes
 
 		void setDisk(ClusterNo clusterNo) { disk = clusterNo; }
 		ClusterNo getDisk() { return disk; }
+																				// swap cache: a resident page whose cluster still holds the same contents, evicting it costs no write
+		bool getSwapCached() { return getV() && getHasCluster() && !getD(); }
+
+	};
 
+	typedef unsigned long long SummaryMask;										// one bit per descriptor of a PMT2
+
+	struct PMT2 {
+		PMT2Descriptor descriptors[PMT2Size];
+																				// summaries of the descriptors' bits, kept in sync by the descriptors' setters
+		std::atomic<SummaryMask> inUseMask, validMask, dirtyMask, sharedMask, copyOnWriteMask;	// (atomic -- frames of one table are locked separately)
+
+		std::mutex mutex;														// page table lock (see LOCK ORDER)
+
+		PMT2Descriptor& operator[](unsigned short index) { return descriptors[index]; }
 	};
 
-	typedef PMT2Descriptor PMT2[PMT2Size];
 	typedef PMT2* PMT1[PMT1Size];
+																				// pages taken by one PMT1/PMT2 slot (1 on 32-bit builds, 2 with 64-bit pointers)
+	static const unsigned short pmtSlotPages = (unsigned short)(((sizeof(PMT2) > sizeof(PMT1) ? sizeof(PMT2) : sizeof(PMT1)) + PAGE_SIZE - 1) / PAGE_SIZE);
+	static const unsigned pmtSlotSize = pmtSlotPages * PAGE_SIZE;				// slots are aligned to their size, so a descriptor finds its PMT2 by masking its address
+	static_assert((pmtSlotSize & (pmtSlotSize - 1)) == 0, "a PMT slot must be a power of two bytes long");
+
+	static SummaryMask rangeMask(unsigned short first, unsigned short count) {	// bits of descriptors [first, first + count)
+		return (count == PMT2Size ? ~(SummaryMask)0 : (((SummaryMask)1 << count) - 1)) << first;
+	}
+	static unsigned short lowestSetBit(SummaryMask mask);						// index of the lowest descriptor in a (non-empty) mask
+	static unsigned short countSetBits(SummaryMask mask);
 
 																				// SHARED SEGMENT ORGANISATION
 
 	struct ReverseSegmentInfo {
 		KernelProcess* process;													// process pointer to a process that is currently sharing a segment
-		PMT2Descriptor* firstDescriptor;										// fast access to the first descriptor for deletion
+		VirtualAddress startAddress;											// start of the process's segment mapping the shared segment
 	};
 
 	struct SharedSegment {
-		std::string name;
 		AccessType accessType;													// the access type for the segment that the process declared would use
 
 		PageNum length = 0;														// length of the shared segment
 		unsigned short pmt2Number;												// number of allocated PMT2s for this shared segment
 
-		PMT1* pmt1;																// pointer to this shared segment's PMT1 table
-
-		ProcessId numberOfProcessesSharing;										// a counter for all the processes that are sharing this segment
-		std::vector<ReverseSegmentInfo> processesSharing;						// remembers relevant pointers to all the processes currently sharing this segment
+		PMT1* pmt1 = nullptr;													// pointer to this shared segment's PMT1 table, nullptr while the handle is free
 
+		std::vector<ReverseSegmentInfo> processesSharing;						// all the process segments currently mapping this segment, in no particular order
+																				// (each of them remembers its index, see KernelProcess::SegmentInfo)
 	};
+																				// a shared segment is known by its handle (its index in the table), the name is only
+																				// looked up when a process connects to, disconnects from or deletes a segment by name
+	typedef unsigned SharedSegmentHandle;
+	static const SharedSegmentHandle noSharedSegment = (SharedSegmentHandle)-1;
+	std::vector<SharedSegment> sharedSegmentTable;								// indexed by handle, the entry of a deleted segment is reused
+	std::vector<SharedSegmentHandle> freeSharedSegmentHandles;
+	std::unordered_map<std::string, SharedSegmentHandle> sharedSegmentNames;
+
+																				// TEARDOWN -- a deleted process's PMT2s are handed to the reclaimer thread, which frees
+																				// their blocks, clusters and slots a batch at a time; meanwhile page faults take their
+																				// frames without writing them out, and batches are freed right away while slots,
+																				// frames or clusters are short
+	std::vector<PMT2*> pendingPMT2s;											// PMT2s of deleted processes (guarded by the mutex)
+	std::atomic<PageNum> numberOfPendingPMT2s{ 0 };
+	std::mutex reclaimMutex;													// only guards the reclaimer's wake-up condition
+	std::condition_variable reclaimCondition;									// signalled when PMT2s are handed over or the system is being destroyed
+	bool stopReclaimer = false;
+	std::thread reclaimer;														// started last in the constructor, joined first in the destructor
 
 	friend class Process;
 	friend class KernelProcess;
@@ -185,26 +332,154 @@ private:
 
 																				// returns address to first descriptor, allocates a new shared segment descriptor table if need be or places pointers to an existing one
 	PMT2Descriptor* connectToSharedSegment(KernelProcess* process, VirtualAddress startAddress,
-		PageNum segmentSize, const char* name, AccessType flags);
+		PageNum segmentSize, const char* name, AccessType flags, SharedSegmentHandle& handle);
+																				// maps the shared segment's PMT2s covering its first _pages_ (a multiple of PMT2Size)
+																				// directly into the process's PMT1 from _firstPMT1Entry_ on, returns the first descriptor
+	PMT2Descriptor* mapSharedSegmentPMT2s(KernelProcess* process, unsigned short firstPMT1Entry, SharedSegment* sharedSegment, PageNum pages);
+																				// the process's segment at _startAddress_ maps the shared segment, returns its sharer index
+	unsigned addSharer(SharedSegmentHandle handle, KernelProcess* process, VirtualAddress startAddress);
+	void removeSharer(SharedSegmentHandle handle, unsigned sharerIndex);		// the last sharer takes the removed one's place (and index)
 
-	PhysicalAddress getSwappedBlock();											// performs the swapping algorithm and returns a block
+	PhysicalAddress getSwappedBlock();											// performs the swapping algorithm and returns a block (with its frame locked)
 
 	PhysicalAddress getFreeBlock();												// retrieves a block from the free block list	
-	void setFreeBlock(PhysicalAddress block);									// places a now free block to the free block list
+	void setFreeBlock(PhysicalAddress block);									// places a now free block to the free block list (the block's frame is locked)
+	bool hasFreeBlocks();
+																				// locks the frame of a resident page (the descriptor's PMT2 is locked), nullptr if it isn't resident
+	ReferenceRegister* lockResidentPage(PMT2Descriptor* descriptor);
+
+	Process* findProcess(ProcessId pid);										// nullptr if there is no such process
+	ProcessId takeProcessID();													// reserves a slot of the process table, noProcessID if it's full
+	void registerProcess(Process* process);										// the process (with a taken ID) can be found from now on
+	void releaseProcessID(ProcessId pid);										// the slot is free again, with the next generation
+																				// generation bookkeeping, the frame is locked
+	void addToYoungestGeneration(ReferenceRegister& blockReg, PMT2Descriptor* descriptor, unsigned char tier);	// the frame's block now holds the page
+	void moveToGeneration(ReferenceRegister& blockReg, unsigned generation);
+	void retireGeneration(unsigned oldest);										// the oldest generation has been emptied, the next one becomes the oldest
+	void removeFromGenerations(ReferenceRegister& blockReg);					// the frame's block no longer holds a page
+	bool takeReferencedBits(ReferenceRegister& blockReg);						// true if any descriptor mapping the block was referenced, the bits are reset
+	unsigned char recordRefault(PMT2Descriptor* descriptor);					// called when a page is loaded, the tier the page starts in
+
+	Status accessPage(KernelProcess* process, VirtualAddress address, AccessType type);	// access() with the process locked
+	Status countPageFault(KernelProcess* process);								// PAGE_FAULT, or TRAP if the process should be blocked for thrashing
 
 	PhysicalAddress getFreePMTSlot();											// retrieves a free PMT1/PMT2 slot (or nullptr if none exist)
+	PageNum getNumberOfAvailablePMTSlots() { return numberOfFreePMTSlots - reservedPMTSlots; }	// free slots that aren't reserved
 	void freePMTSlot(PhysicalAddress slotAddress);								// places a now free PMT1/PMT2 slot to the free slot list
-
-	void initialisePMT2(PMT2* pmt2);											// called when a new PMT2 is created
+	PMT1* getFreePMT1();														// a free slot holding a PMT1 with all of its entries set to nullptr
+	void freePMT1(PMT1* pmt1);													// the PMT1 of a deleted process (all of its entries must be nullptr)
+
+	static unsigned short magazineIndex();										// the calling thread's magazine
+																				// pops a free entry off the thread's magazine (refilled from the stack, or taken from another thread's)
+	std::uint32_t takeFromMagazines(Magazine* magazines, IndexStack* stack);		// IndexStack::empty if there are none
+	void putIntoMagazine(Magazine* magazines, std::uint32_t entry, IndexStack* stack);
+
+	void initialisePMT2(PMT2* pmt2);											// called when a new PMT2 is created (constructs it in its slot)
+																				// descriptors [first, first + count) of a PMT2 start being used (they must be free)
+	void initialiseDescriptors(PMT2* pmt2, unsigned short first, unsigned short count, AccessType flags, bool shared);
+	PageNum countMissingPMT2s(KernelProcess* process, VirtualAddress startAddress, PageNum pages);	// PMT2s the process lacks for the pages
+	PMT2* getWritablePMT2(KernelProcess* process, unsigned short pmt1Entry);	// the process's PMT2, created if missing and copied if shared with a clone
+	PMTSlotInfo& getSlotInfo(PMT2* pmt2) { return pmtSlotInfo[((char*)pmt2 - (char*)pmtSlotsStart) / pmtSlotSize]; }
+
+	bool isPMT2Shared(PMT2* pmt2) { return getSlotInfo(pmt2).extraHolders > 0; }
+	bool isSharedSegmentPMT2(PMT2* pmt2) { return getSlotInfo(pmt2).ofSharedSegment; }
+	PMT2* unsharePMT2(KernelProcess* process, unsigned short pmt1Entry);		// gives the process a private copy of a shared PMT2 (uses up a reserved slot), the shared one is locked
+	void dropSharedPMT2s(KernelProcess* process);								// unlinks the process from the PMT2s it shares, used when the process is deleted
+	void deferTeardown(KernelProcess* process);									// hands the deleted process's PMT2s to the reclaimer and frees its PMT1
+	void reclaimPendingPMT2s(PageNum limit);									// frees the pages and slots of up to _limit_ PMT2s of deleted processes
+	bool hasAvailablePMTSlots(PageNum needed);									// frees pending PMT2s first until there are _needed_ unreserved slots
+	static void reclaimWorker(KernelSystem* system);							// the reclaimer thread
+
+	ClusterNo clusterLocalityHint(PMT2Descriptor* descriptor);					// preferred cluster for a page, next to the clusters of its PMT2 neighbours
+
+	void setDirty(PMT2Descriptor* descriptor);									// marks a page dirty, drops its (now stale) cluster if disk space is low
+	bool reclaimSwapCache(ClusterNo clustersNeeded);							// frees stale clusters of dirty resident pages, true if _clustersNeeded_ clusters are free afterwards
+
+	ReferenceRegister& blockRegister(PhysicalAddress block) { return referenceRegisters[((char*)block - (char*)processVMSpace) / PAGE_SIZE]; }
+
+	void shareBlock(PMT2Descriptor* original, PMT2Descriptor* copy);			// _copy_ maps the same page as _original_, both become copy on write
+	bool detachDeletedMappings(ReferenceRegister& blockReg);					// drops a locked frame's descriptors of deleted processes, true if nobody maps it anymore
+	bool detachFromBlock(PMT2Descriptor* descriptor);							// removes a resident descriptor from its block's mappers, true if nobody maps the block anymore
+	void releasePage(PMT2Descriptor* descriptor);								// drops the descriptor's block and cluster (they're freed once nobody else maps them)
+																				// gives a resident copy on write page a block of its own (or takes over the shared one)
+	Status resolveCopyOnWrite(PMT2Descriptor* descriptor);						// the descriptor's table and frame are locked
+																				// writes a resident page out if needed and marks every descriptor mapping its block as not resident
+	bool evictPage(PMT2Descriptor* descriptor, bool asynchronous = false);		// false if there was no room on the disk or the write failed (the frame is locked)
+	void restoreEvictedPage(PhysicalAddress block, const std::vector<PMT2Descriptor*>& mappings, bool dirty);	// undoes an asynchronous eviction whose write failed
+
+	void deduplicatePages();													// merges resident read-only/execute pages with identical contents
+	void mergePages(PMT2Descriptor* duplicate, PMT2Descriptor* original);		// everything mapping _duplicate_'s block is moved to _original_'s block
+
+	static unsigned long long hashBlock(PhysicalAddress block);					// FNV-1a hash of a block's contents
 
 	static unsigned short extractPage1Part(VirtualAddress address);				// extraction methods for the virtual address parts
 	static unsigned short extractPage2Part(VirtualAddress address);
 	static unsigned short extractWordPart(VirtualAddress address);
 
-	// unsigned simpleHash(unsigned a, unsigned b) { return ((a + 1) * b + 3) % activeProcesses.max_size(); }
-	unsigned simpleHash(unsigned a, unsigned b) { return (((a + b) * (a + b + 1)) / 2 + b) % activeProcesses.max_size(); }
-
 };
 
+																				// descriptor bits mirrored in the PMT2 summary masks
+
+inline KernelSystem::PMT2* KernelSystem::PMT2Descriptor::getTable() { return (PMT2*)((uintptr_t)this & ~(uintptr_t)(pmtSlotSize - 1)); }
+inline unsigned short KernelSystem::PMT2Descriptor::getIndex() { return (unsigned short)(this - getTable()->descriptors); }
+
+inline void KernelSystem::PMT2Descriptor::setV() { basicBits |= 0x01; getTable()->validMask |= (SummaryMask)1 << getIndex(); }
+inline void KernelSystem::PMT2Descriptor::resetV() { basicBits &= 0xFE; getTable()->validMask &= ~((SummaryMask)1 << getIndex()); }
+inline void KernelSystem::PMT2Descriptor::setD() { basicBits |= 0x02; getTable()->dirtyMask |= (SummaryMask)1 << getIndex(); }
+inline void KernelSystem::PMT2Descriptor::resetD() { basicBits &= 0xFD; getTable()->dirtyMask &= ~((SummaryMask)1 << getIndex()); }
+inline void KernelSystem::PMT2Descriptor::setCopyOnWrite() { advancedBits |= 0x20; getTable()->copyOnWriteMask |= (SummaryMask)1 << getIndex(); }
+inline void KernelSystem::PMT2Descriptor::resetCopyOnWrite() { advancedBits &= 0xDF; getTable()->copyOnWriteMask &= ~((SummaryMask)1 << getIndex()); }
+inline void KernelSystem::PMT2Descriptor::setShared() { advancedBits |= 0x10; getTable()->sharedMask |= (SummaryMask)1 << getIndex(); }
+inline void KernelSystem::PMT2Descriptor::resetShared() { advancedBits &= 0xEF; getTable()->sharedMask &= ~((SummaryMask)1 << getIndex()); }
+inline void KernelSystem::PMT2Descriptor::setInUse() { advancedBits |= 0x01; getTable()->inUseMask |= (SummaryMask)1 << getIndex(); }
+inline void KernelSystem::PMT2Descriptor::resetInUse() { advancedBits &= 0xFE; getTable()->inUseMask &= ~((SummaryMask)1 << getIndex()); }
+
+inline void KernelSystem::PMT2Descriptor::setBits(char newBasicBits, char newAdvancedBits) {
+	PMT2* table = getTable();
+	SummaryMask bit = (SummaryMask)1 << getIndex();
+
+	basicBits = newBasicBits;
+	advancedBits = newAdvancedBits;
+
+	if (getV()) table->validMask |= bit; else table->validMask &= ~bit;
+	if (getD()) table->dirtyMask |= bit; else table->dirtyMask &= ~bit;
+	if (getCopyOnWrite()) table->copyOnWriteMask |= bit; else table->copyOnWriteMask &= ~bit;
+	if (getShared()) table->sharedMask |= bit; else table->sharedMask &= ~bit;
+	if (getInUse()) table->inUseMask |= bit; else table->inUseMask &= ~bit;
+}
+
+inline void KernelSystem::PMT2Descriptor::release() {
+	setBits(0, 0);
+	evictionStamp = 0;
+	block = nullptr;															// a later segment reusing the descriptor must not see the old links
+	disk = 0;
+}
+
+inline Process* KernelSystem::findProcess(ProcessId pid) {
+	ProcessId slot = pid & processSlotMask;										// no hashing, the ID names the slot
+	if (slot >= processTableSize) return nullptr;
+	Process* process = processTable[slot].process.load(std::memory_order_acquire);
+	return processTable[slot].pid.load(std::memory_order_relaxed) == pid ? process : nullptr;
+}
+
+inline unsigned short KernelSystem::lowestSetBit(SummaryMask mask) {
+#if defined(_MSC_VER)
+	unsigned long index;														// 32-bit scans work on both x86 and x64 builds
+	if (_BitScanForward(&index, (unsigned long)mask)) return (unsigned short)index;
+	_BitScanForward(&index, (unsigned long)(mask >> 32));
+	return (unsigned short)(index + 32);
+#else
+	return (unsigned short)__builtin_ctzll(mask);
+#endif
+}
+
+inline unsigned short KernelSystem::countSetBits(SummaryMask mask) {
+#if defined(_MSC_VER)
+	return (unsigned short)(__popcnt((unsigned)mask) + __popcnt((unsigned)(mask >> 32)));
+#else
+	return (unsigned short)__builtin_popcountll(mask);
+#endif
+}
+
 
 #endif
\ No newline at end of file
@@ -0,0 +1,46 @@
+#ifndef _objectpool_h_
+#define _objectpool_h_
+
+#include <cstddef>
+#include <mutex>
+#include <new>
+
+// Memory for objects of type T, used by the class specific operator new/delete of Process and KernelProcess, so that
+// processes that are created and deleted at a high rate don't go to the heap every time. A deleted object's memory is
+// put on a free list (the link is kept in the memory itself) and handed out to the next object, it's never given back.
+
+template <typename T>
+class ObjectPool {
+public:
+
+	static void* allocate(std::size_t size) {
+		if (size != sizeof(T)) return ::operator new(size);				// (a derived class)
+
+		std::lock_guard<std::mutex> guard(mutex());
+		FreeObject* object = freeList();
+		if (!object) return ::operator new(sizeof(T) < sizeof(FreeObject) ? sizeof(FreeObject) : sizeof(T));
+		freeList() = object->next;
+		return object;
+	}
+
+	static void release(void* memory, std::size_t size) {
+		if (!memory) return;
+		if (size != sizeof(T)) { ::operator delete(memory); return; }
+
+		std::lock_guard<std::mutex> guard(mutex());
+		FreeObject* object = new (memory) FreeObject;
+		object->next = freeList();
+		freeList() = object;
+	}
+
+private:
+
+	struct FreeObject {
+		FreeObject* next;
+	};
+
+	static std::mutex& mutex() { static std::mutex poolMutex; return poolMutex; }	// (function statics -- usable during static initialisation)
+	static FreeObject*& freeList() { static FreeObject* head = nullptr; return head; }
+};
+
+#endif
@@ -1,4 +1,5 @@
 #include "KernelProcess.h"
+#include "ObjectPool.h"
 #include "Process.h"
 #include "vm_declarations.h"
 
@@ -10,6 +11,14 @@ Process::~Process() {
 	delete pProcess;
 }
 
+void* Process::operator new(std::size_t size) {
+	return ObjectPool<Process>::allocate(size);
+}
+
+void Process::operator delete(void* object, std::size_t size) {
+	ObjectPool<Process>::release(object, size);
+}
+
 ProcessId Process::getProcessId() const {
 	return pProcess->getProcessId();
 }
@@ -40,8 +49,8 @@ void Process::blockIfThrashing() {
 	return pProcess->blockIfThrashing();
 }
 
-Process* Process::clone(ProcessId pid) {
-	return pProcess->clone(pid);
+Process* Process::clone(ProcessId) {										// the clone's ID is assigned by the process table
+	return pProcess->clone();
 }
 
 Status Process::createSharedSegment(VirtualAddress startAddress, PageNum segmentSize, const char* name, AccessType flags) {
@@ -2,6 +2,7 @@
 
 #define _process_h_
 
+#include <cstddef>
 #include "vm_declarations.h"
 
 class KernelProcess;
@@ -16,6 +17,9 @@ public:
 
 	~Process();
 
+	static void* operator new(std::size_t size);		// process objects are pooled (see ObjectPool.h)
+	static void operator delete(void* object, std::size_t size);
+
 	ProcessId getProcessId() const;
 
 	Status createSegment(VirtualAddress startAddress, PageNum segmentSize,
@@ -6,6 +6,11 @@ System::System(PhysicalAddress processVMSpace, PageNum processVMSpaceSize, Physi
 	pSystem = new KernelSystem(processVMSpace, processVMSpaceSize, pmtSpace, pmtSpaceSize, partition);
 }
 
+System::System(PhysicalAddress processVMSpace, PageNum processVMSpaceSize, PhysicalAddress pmtSpace, PageNum pmtSpaceSize,
+	Partition** partitions, unsigned short numberOfPartitions, StripingPolicy policy) {
+	pSystem = new KernelSystem(processVMSpace, processVMSpaceSize, pmtSpace, pmtSpaceSize, partitions, numberOfPartitions, policy);
+}
+
 System::~System() {
 	delete pSystem;
 }
@@ -26,4 +31,20 @@ Status System::access(ProcessId pid, VirtualAddress address, AccessType type) {
 
 Process* System::cloneProcess(ProcessId pid) {
 	return pSystem->cloneProcess(pid);
+}
+
+std::vector<Process*> System::cloneProcessN(ProcessId pid, unsigned n) {
+	return pSystem->cloneProcessN(pid, n);
+}
+
+void System::setDeduplication(bool enabled) {
+	pSystem->setDeduplication(enabled);
+}
+
+DeduplicationStatistics System::getDeduplicationStatistics() {
+	return pSystem->getDeduplicationStatistics();
+}
+
+ReplacementStatistics System::getReplacementStatistics() {
+	return pSystem->getReplacementStatistics();
 }
\ No newline at end of file
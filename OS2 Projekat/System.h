@@ -2,6 +2,8 @@
 
 #define _system_h_
 
+#include <vector>
+
 #include "vm_declarations.h"
 
 class Partition;
@@ -17,6 +19,11 @@ public:
 		PhysicalAddress pmtSpace, PageNum pmtSpaceSize,
 		Partition* partition);
 
+	// Swap space striped over several partitions
+	System(PhysicalAddress processVMSpace, PageNum processVMSpaceSize,
+		PhysicalAddress pmtSpace, PageNum pmtSpaceSize,
+		Partition** partitions, unsigned short numberOfPartitions, StripingPolicy policy = ROUND_ROBIN);
+
 	~System();
 
 	Process* createProcess();
@@ -27,6 +34,12 @@ public:
 	Status access(ProcessId pid, VirtualAddress address, AccessType type);
 
 	Process* cloneProcess(ProcessId pid);
+	std::vector<Process*> cloneProcessN(ProcessId pid, unsigned n);	// n clones of the same process, all or none (empty vector)
+
+	void setDeduplication(bool enabled);
+	DeduplicationStatistics getDeduplicationStatistics();
+
+	ReplacementStatistics getReplacementStatistics();
 
 private:
 	KernelSystem *pSystem;
@@ -310,3 +310,124 @@ int main()
 //	*(char *)paddr = (char)-1;
 //
 //}
+
+// cloneProcessN benchmark (repeated cloneProcess() vs one cloneProcessN() for the same number of children)
+
+/*
+#define VM_SPACE_SIZE (1000)
+#define PMT_SPACE_SIZE (12000)
+#define N_CHILDREN (64)
+#define N_ROUNDS (200)
+
+PhysicalAddress alignPointer(PhysicalAddress address) {
+	uint64_t addr = reinterpret_cast<uint64_t> (address);
+
+	addr += PAGE_SIZE;
+	addr = addr / PAGE_SIZE * PAGE_SIZE;
+
+	return reinterpret_cast<PhysicalAddress> (addr);
+}
+
+int main()
+{
+	Partition part("p1.ini");
+
+	PhysicalAddress vmSpace = (PhysicalAddress) new char[(VM_SPACE_SIZE + 2) * PAGE_SIZE];
+	PhysicalAddress pmtSpace = (PhysicalAddress) new char[(PMT_SPACE_SIZE + 2) * PAGE_SIZE];
+
+	System system(alignPointer(vmSpace), VM_SPACE_SIZE, alignPointer(pmtSpace), PMT_SPACE_SIZE, &part);
+
+	Process * parent = system.createProcess();
+	for (VirtualAddress address = 0; address < (40 << 16); address += (1 << 16))	// 40 PMT2s
+		parent->createSegment(address, 8, READ_WRITE);
+
+	double single = 0, batched = 0;
+	for (int round = 0; round < N_ROUNDS; round++) {
+		std::vector<Process*> children;
+
+		auto start = std::chrono::steady_clock::now();
+		for (int i = 0; i < N_CHILDREN; i++)
+			children.push_back(system.cloneProcess(parent->getProcessId()));
+		single += std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+		for (Process* child : children) delete child;
+
+		start = std::chrono::steady_clock::now();
+		children = system.cloneProcessN(parent->getProcessId(), N_CHILDREN);
+		batched += std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+		for (Process* child : children) delete child;
+	}
+
+	std::cout << "cloneProcess x" << N_CHILDREN << ": " << single / N_ROUNDS / N_CHILDREN << " us per child\n";
+	std::cout << "cloneProcessN(" << N_CHILDREN << "): " << batched / N_ROUNDS / N_CHILDREN << " us per child\n";
+
+	delete parent;
+	delete[] vmSpace;
+	delete[] pmtSpace;
+}
+*/
+
+// free list benchmark (the lock-free IndexStack vs the mutex protected intrusive list it replaced, 1-64 threads)
+
+/*
+#include <mutex>
+#include <vector>
+#include "IndexStack.h"
+
+#define N_BLOCKS (4096)
+#define N_OPERATIONS (2000000)													// pop + push pairs, split among the threads
+
+struct LockedList {																// the old free block list: each free block holds the address of the next one
+	std::mutex mutex;
+	PhysicalAddress head = nullptr;
+
+	PhysicalAddress pop() {
+		std::lock_guard<std::mutex> guard(mutex);
+		PhysicalAddress block = head;
+		if (block) head = *(PhysicalAddress*)block;
+		return block;
+	}
+	void push(PhysicalAddress block) {
+		std::lock_guard<std::mutex> guard(mutex);
+		*(PhysicalAddress*)block = head;
+		head = block;
+	}
+};
+
+template <typename Work>
+double measure(int numberOfThreads, Work work) {								// millions of pop + push pairs per second
+	std::vector<std::thread> threads;
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < numberOfThreads; i++)
+		threads.emplace_back(work, N_OPERATIONS / numberOfThreads);
+	for (std::thread& thread : threads) thread.join();
+	return N_OPERATIONS / std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main()
+{
+	char* memory = new char[(N_BLOCKS + 1) * PAGE_SIZE];
+
+	for (int numberOfThreads = 1; numberOfThreads <= 64; numberOfThreads *= 2) {
+		LockedList list;
+		for (int i = N_BLOCKS - 1; i >= 0; i--) list.push(memory + i * PAGE_SIZE);
+		double locked = measure(numberOfThreads, [&list](int operations) {
+			for (int i = 0; i < operations; i++) {
+				PhysicalAddress block = list.pop();
+				if (block) list.push(block);
+			}
+		});
+
+		IndexStack stack(N_BLOCKS, true);
+		double lockFree = measure(numberOfThreads, [&stack](int operations) {
+			for (int i = 0; i < operations; i++) {
+				std::uint32_t block = stack.pop();
+				if (block != IndexStack::empty) stack.push(block);
+			}
+		});
+
+		std::cout << numberOfThreads << " threads: mutex list " << locked << " Mops/s, IndexStack " << lockFree << " Mops/s\n";
+	}
+
+	delete[] memory;
+}
+*/
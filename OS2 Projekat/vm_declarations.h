@@ -11,6 +11,21 @@ enum Status { OK, PAGE_FAULT, TRAP };
 enum AccessType { READ, WRITE, READ_WRITE, EXECUTE };
 typedef unsigned ProcessId;
 #define PAGE_SIZE 1024 
+enum StripingPolicy { ROUND_ROBIN, LEAST_LOADED };		// how swap space is spread over several partitions
+
+struct DeduplicationStatistics {
+	PageNum pagesMerged = 0;		// pages that were redirected to an identical page's frame
+	PageNum framesSaved = 0;		// physical blocks released by merging (memory saved = framesSaved * PAGE_SIZE)
+	PageNum clustersSaved = 0;		// partition clusters released by merging
+};
+
+struct ReplacementStatistics {
+	PageNum evictions = 0;			// pages swapped out to make room
+	PageNum refaults = 0;			// evicted pages that were loaded again
+	PageNum shortRefaults = 0;		// refaults within as many evictions as there are blocks (the page is protected for a while)
+	unsigned long long refaultDistanceSum = 0;	// evictions between each page's eviction and its refault (average = sum / refaults)
+	unsigned generations = 0;		// generations the resident pages are currently spread over
+};
 
 
 #endif
\ No newline at end of file